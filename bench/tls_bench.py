@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+#          Copyright Michael Shmalko 2016.
+# Distributed under the Boost Software License, Version 1.0.
+#    (See accompanying file LICENSE_1_0.txt or copy at
+#          http://www.boost.org/LICENSE_1_0.txt)
+
+# TLS termination benchmark for a nano_balancer built with NANO_BALANCER_TLS.
+# Starts an echo backend and two balancer children on loopback, one with tls_cert and one plain,
+# and reports:
+#   - full and resumed handshakes per second (TLS 1.2 and 1.3)
+#   - relay throughput and balancer CPU seconds per GB echoed, TLS against plain
+#   - whether the kernel took the records (kTLS), from the /proc/net/tls_stat counters
+# usage: tls_bench.py <nano_balancer binary> <cert.pem> <key.pem> [--mb 1024] [--handshakes 2000] [--clients 4]
+
+import argparse, multiprocessing, os, socket, ssl, subprocess, sys, tempfile, threading, time
+
+ECHO_PORT, TLS_PORT, PLAIN_PORT = 19901, 19902, 19903
+CLK_TCK = os.sysconf('SC_CLK_TCK')
+
+
+def echo_server(port):
+    listener = socket.socket()
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(('127.0.0.1', port))
+    listener.listen(512)
+
+    def serve(connection):
+        with connection:
+            while True:
+                data = connection.recv(1 << 20)
+                if not data:
+                    return
+                connection.sendall(data)
+
+    while True:
+        connection, _ = listener.accept()
+        threading.Thread(target=serve, args=(connection,), daemon=True).start()
+
+
+def client_context(version):
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    context.check_hostname = False
+    context.verify_mode = ssl.CERT_NONE
+    context.minimum_version = context.maximum_version = version
+    return context
+
+
+def handshakes(args):
+    count, version, resume = args
+    context = client_context(version)
+    session = None
+    for _ in range(count):
+        with socket.create_connection(('127.0.0.1', TLS_PORT)) as raw:
+            with context.wrap_socket(raw, session=session) as connection:
+                if version == ssl.TLSVersion.TLSv1_3:
+                    # TLS 1.3 tickets arrive after the handshake, a read gets them processed
+                    connection.sendall(b'x')
+                    connection.recv(1)
+                if resume:
+                    session = connection.session
+    return count
+
+
+def handshake_rate(count, clients, version, resume):
+    started = time.time()
+    with multiprocessing.Pool(clients) as pool:
+        done = sum(pool.map(handshakes, [(count // clients, version, resume)] * clients))
+    return done / (time.time() - started)
+
+
+def cpu_seconds(pid):
+    with open('/proc/%d/stat' % pid) as stat:
+        fields = stat.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / CLK_TCK
+
+
+def tls_stat():
+    try:
+        with open('/proc/net/tls_stat') as stat:
+            return dict((line.split()[0], int(line.split()[1])) for line in stat if line.strip())
+    except OSError:
+        return None
+
+
+def relay(port, pid, total_mb, tls):
+    connection = socket.create_connection(('127.0.0.1', port))
+    if tls:
+        connection = client_context(ssl.TLSVersion.TLSv1_2).wrap_socket(connection)
+    total = total_mb << 20
+    chunk = b'z' * (1 << 16)
+    received = [0]
+
+    def reader():
+        while received[0] < total:
+            data = connection.recv(1 << 20)
+            if not data:
+                break
+            received[0] += len(data)
+
+    thread = threading.Thread(target=reader)
+    cpu_before, started = cpu_seconds(pid), time.time()
+    thread.start()
+    for _ in range(total // len(chunk)):
+        connection.sendall(chunk)
+    thread.join()
+    elapsed, cpu = time.time() - started, cpu_seconds(pid) - cpu_before
+    connection.close()
+    # bytes cross the balancer twice, client to backend and back
+    return total * 2 / elapsed / 1e6, cpu / (total * 2 / 1e9)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('binary')
+    parser.add_argument('cert')
+    parser.add_argument('key')
+    parser.add_argument('--mb', type=int, default=1024)
+    parser.add_argument('--handshakes', type=int, default=2000)
+    parser.add_argument('--clients', type=int, default=4)
+    args = parser.parse_args()
+
+    threading.Thread(target=echo_server, args=(ECHO_PORT,), daemon=True).start()
+    workdir = tempfile.mkdtemp(prefix='nb_tls_bench_')
+    config = os.path.join(workdir, 'bench.config')
+    with open(config, 'w') as f:
+        f.write('127.0.0.1:%d\n' % ECHO_PORT)
+    balancers = [
+        subprocess.Popen([os.path.abspath(args.binary), '127.0.0.1', str(TLS_PORT), config,
+                          'tls_cert=' + os.path.abspath(args.cert), 'tls_key=' + os.path.abspath(args.key)],
+                         cwd=workdir, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL),
+        subprocess.Popen([os.path.abspath(args.binary), '127.0.0.1', str(PLAIN_PORT), config],
+                         cwd=workdir, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)]
+    try:
+        # the first probe marks the backend good
+        time.sleep(1.5)
+        for name, version in (('TLS 1.2', ssl.TLSVersion.TLSv1_2), ('TLS 1.3', ssl.TLSVersion.TLSv1_3)):
+            full = handshake_rate(args.handshakes, args.clients, version, False)
+            resumed = handshake_rate(args.handshakes, args.clients, version, True)
+            print('%s handshakes/s: full %.0f, resumed %.0f' % (name, full, resumed))
+
+        before = tls_stat()
+        tls_rate, tls_cpu = relay(TLS_PORT, balancers[0].pid, args.mb, True)
+        after = tls_stat()
+        plain_rate, plain_cpu = relay(PLAIN_PORT, balancers[1].pid, args.mb, False)
+        print('TLS 1.2 relay: %.0f MB/s, %.2f balancer CPU s/GB' % (tls_rate, tls_cpu))
+        print('plain relay:   %.0f MB/s, %.2f balancer CPU s/GB' % (plain_rate, plain_cpu))
+        if before is None:
+            print('kTLS: not available, no /proc/net/tls_stat (tls module not loaded), user space crypto measured')
+        else:
+            print('kTLS: tx sw %d, rx sw %d connections during the relay' % (
+                after.get('TlsTxSw', 0) - before.get('TlsTxSw', 0), after.get('TlsRxSw', 0) - before.get('TlsRxSw', 0)))
+    finally:
+        for balancer in balancers:
+            balancer.terminate()
+
+
+if __name__ == '__main__':
+    sys.exit(main())
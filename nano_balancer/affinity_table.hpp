@@ -0,0 +1,135 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <boost/asio/ip/address.hpp>
+#include "client_key.hpp"
+
+namespace nano_balancer
+{
+	namespace ip = boost::asio::ip;
+
+	// Bounded client address -> backend id table with a sliding TTL.
+	// Open addressing over fixed groups of 16 entries (4 cache lines), a client always maps into
+	// one group, so a lookup touches at most one group and takes one spin lock per group.
+	// A full group evicts its entry closest to expiry, memory is fixed at 16 bytes per entry.
+	class affinity_table
+	{
+		enum definitions
+		{
+			bucket_entries = 4,
+			group_buckets = 4,
+			group_entries = bucket_entries * group_buckets,
+			min_capacity = group_entries
+		};
+
+		struct alignas(64) bucket
+		{
+			std::uint64_t key[bucket_entries];
+			std::uint32_t node[bucket_entries];
+			std::uint32_t expires[bucket_entries];
+		};
+		static_assert(sizeof(bucket) == 64, "affinity bucket must fill one cache line");
+
+	public:
+		affinity_table(size_t capacity, unsigned int ttl_sec) :
+			ttl_(ttl_sec),
+			epoch_(std::chrono::steady_clock::now())
+		{
+			size_t entries = min_capacity;
+			while (entries < capacity)
+			{
+				entries <<= 1;
+			}
+			group_mask_ = entries / group_entries - 1;
+			buckets_.reset(new bucket[entries / bucket_entries]());
+			locks_.reset(new std::atomic_flag[group_mask_ + 1]);
+			for (size_t i = 0; i <= group_mask_; ++i)
+			{
+				locks_[i].clear();
+			}
+		}
+
+		size_t capacity() const
+		{
+			return (group_mask_ + 1) * group_entries;
+		}
+
+		// Returns the backend id the client is bound to. Entries that expired or whose backend
+		// fails valid(id) are re-routed through pick(id); false when pick has no backend to offer.
+		template <class Valid, class Pick>
+		bool route(const ip::address& client, Valid valid, Pick pick, std::uint32_t& node)
+		{
+			const auto key = client_key(client);
+			const auto hash = client_hash(key);
+			const auto group = static_cast<size_t>(hash >> 32) & group_mask_;
+			const auto now = now_sec();
+			auto buckets = &buckets_[group * group_buckets];
+
+			spin_lock_guard lock(locks_[group]);
+
+			// oldest entry of the group, reused when the client is not found
+			bucket* victim = &buckets[0];
+			size_t victim_slot = 0;
+			for (size_t b = 0; b < group_buckets; ++b)
+			{
+				auto& bk = buckets[b];
+				for (size_t i = 0; i < bucket_entries; ++i)
+				{
+					if (bk.key[i] == key)
+					{
+						if (bk.expires[i] > now && valid(bk.node[i]))
+						{
+							bk.expires[i] = now + ttl_;
+							node = bk.node[i];
+							return true;
+						}
+						// expired or failed backend, fail over in place
+						if (!pick(node))
+						{
+							bk.key[i] = 0;
+							return false;
+						}
+						bk.node[i] = node;
+						bk.expires[i] = now + ttl_;
+						return true;
+					}
+					if (bk.expires[i] < victim->expires[victim_slot])
+					{
+						victim = &bk;
+						victim_slot = i;
+					}
+				}
+			}
+
+			if (!pick(node))
+			{
+				return false;
+			}
+			victim->key[victim_slot] = key;
+			victim->node[victim_slot] = node;
+			victim->expires[victim_slot] = now + ttl_;
+			return true;
+		}
+
+	private:
+		std::uint32_t now_sec() const
+		{
+			// starts at 1 so zeroed entries always look expired
+			return static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(
+				std::chrono::steady_clock::now() - epoch_).count()) + 1;
+		}
+
+		const std::uint32_t ttl_;
+		const std::chrono::steady_clock::time_point epoch_;
+		size_t group_mask_;
+		std::unique_ptr<bucket[]> buckets_;
+		std::unique_ptr<std::atomic_flag[]> locks_;
+	};
+}
@@ -0,0 +1,54 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <boost/asio/ip/address.hpp>
+
+namespace nano_balancer
+{
+	namespace ip = boost::asio::ip;
+
+	// 64 bit key of a client address for the per-client tables, never 0
+	inline std::uint64_t client_key(const ip::address& client)
+	{
+		if (client.is_v4())
+		{
+			// tag v4 keys so they never collide with the empty key or v6 fingerprints
+			return (1ull << 32) | client.to_v4().to_uint();
+		}
+		// 64 bit FNV-1a fingerprint of the v6 address
+		std::uint64_t key = 0xcbf29ce484222325ull;
+		for (auto b : client.to_v6().to_bytes())
+		{
+			key = (key ^ b) * 0x100000001b3ull;
+		}
+		return key | (1ull << 63);
+	}
+
+	// spreads client keys over the table groups
+	inline std::uint64_t client_hash(std::uint64_t key)
+	{
+		return key * 0x9E3779B97F4A7C15ull;
+	}
+
+	// guards one group of a per-client table, held for a few dozen instructions at most
+	class spin_lock_guard
+	{
+		std::atomic_flag& flag_;
+	public:
+		explicit spin_lock_guard(std::atomic_flag& flag) : flag_(flag)
+		{
+			while (flag_.test_and_set(std::memory_order_acquire))
+			{
+			}
+		}
+		~spin_lock_guard()
+		{
+			flag_.clear(std::memory_order_release);
+		}
+	};
+}
@@ -0,0 +1,452 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include "logging.h"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define NANO_BALANCER_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define NANO_BALANCER_TSC 1
+#endif
+
+namespace nano_balancer
+{
+	namespace ip = boost::asio::ip;
+
+	// Always-on, fixed memory record of tunnel lifecycle events for one event loop.
+	// Events are 32 byte binary records written to a ring by the loop thread, without locks or allocation,
+	// the oldest events are overwritten. Timestamps are raw TSC ticks on x86 and steady clock elsewhere,
+	// converted to time when dumped. The ring is dumped to a file on SIGUSR2 (where the platform has it)
+	// or on a connection to the admin port, both handled on the loop thread so the dump sees no torn events.
+	// nano_balancer --decode <file> prints a dump as per connection timelines.
+	class flight_recorder : public boost::enable_shared_from_this<flight_recorder>
+	{
+	public:
+		typedef boost::shared_ptr<flight_recorder> ptr_type;
+		typedef std::chrono::steady_clock clock_type;
+
+		enum event_kind : std::uint8_t
+		{
+			accepted,		// client address and port
+			backend_chosen,	// backend address and port
+			connect_started,
+			connected,
+			handshake_done,
+			first_byte,		// detail: relay direction
+			byte_totals,	// values: bytes to the backend, bytes to the client
+			closed,			// detail: close reason, values: error code
+			event_kinds
+		};
+
+		enum close_reason : std::uint8_t
+		{
+			closed_by_peer,		// end of file from either side
+			closed_on_error,	// read or write error
+			rejected,			// by the relay filter
+			no_backend,
+			no_source,
+			bind_failed,
+			connect_failed,
+			handshake_failed,
+			proxy_header_failed,
+			close_reasons
+		};
+
+		struct event
+		{
+			// monotonic ticks, see dump_header
+			std::uint64_t ticks;
+			std::uint32_t connection;
+			std::uint8_t kind;
+			std::uint8_t detail;
+			std::uint16_t port;
+			union
+			{
+				unsigned char address[16];
+				std::uint64_t values[2];
+			};
+		};
+
+		// dump file header, followed by count events oldest first, all native byte order
+		struct dump_header
+		{
+			char magic[4];
+			std::uint32_t version;
+			std::uint32_t event_size;
+			std::uint32_t count;
+			// events recorded since start, more than count when the ring wrapped
+			std::uint64_t recorded;
+			// wall clock at start_ticks, microseconds since the unix epoch
+			std::int64_t epoch_us;
+			std::uint64_t start_ticks;
+			double ns_per_tick;
+		};
+
+		enum definitions
+		{
+			dump_version = 2,
+			// dump files kept, the oldest is removed when a new one is written
+			max_dump_files = 16,
+			// a trigger within this time of the last dump gets that dump instead of a new one
+			min_dump_interval_ms = 1000
+		};
+
+		// capacity is rounded up to a power of two
+		flight_recorder(logger_type& logger, boost::asio::io_service& ios, unsigned int capacity, const std::string& file_prefix) :
+			logger_(logger),
+			mask_(round_up(capacity) - 1),
+			events_(new event[mask_ + 1]),
+			head_(0),
+			next_connection_(0),
+			started_(clock_type::now()),
+			start_ticks_(ticks()),
+			epoch_us_(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count()),
+			file_prefix_(file_prefix),
+			dumps_(0),
+			signals_(ios),
+			admin_(ios),
+			admin_socket_(ios)
+		{
+			std::memset(events_.get(), 0, sizeof(event) * (mask_ + 1));
+		}
+
+		// dump triggers: SIGUSR2 and, when not 0, every connection to the loopback admin port,
+		// at most one dump a second whatever the trigger
+		void start(unsigned short admin_port)
+		{
+#if defined(SIGUSR2)
+			signals_.add(SIGUSR2);
+			wait_signal();
+#endif
+			if (admin_port != 0)
+			{
+				admin_.open(ip::tcp::v4());
+				admin_.set_option(ip::tcp::acceptor::reuse_address(true));
+				admin_.bind(ip::tcp::endpoint(ip::address_v4::loopback(), admin_port));
+				admin_.listen();
+				accept_admin();
+			}
+			BOOST_LOG_SEV(logger_, trivial::info) << "Flight recorder: " << mask_ + 1 << " events"
+				<< (admin_port != 0 ? ", admin port " + std::to_string(admin_port) : std::string());
+		}
+
+		std::uint32_t next_connection()
+		{
+			return ++next_connection_;
+		}
+
+		void record(std::uint32_t connection, event_kind kind, std::uint8_t detail = 0, std::uint64_t value0 = 0, std::uint64_t value1 = 0)
+		{
+			auto& e = next(connection, kind);
+			e.detail = detail;
+			e.port = 0;
+			e.values[0] = value0;
+			e.values[1] = value1;
+			commit();
+		}
+
+		void record(std::uint32_t connection, event_kind kind, const ip::address& address, unsigned short port)
+		{
+			auto& e = next(connection, kind);
+			e.port = port;
+			if (address.is_v6())
+			{
+				e.detail = 6;
+				const auto bytes = address.to_v6().to_bytes();
+				std::memcpy(e.address, bytes.data(), bytes.size());
+			}
+			else
+			{
+				e.detail = 4;
+				const auto bytes = address.to_v4().to_bytes();
+				e.values[0] = 0;
+				e.values[1] = 0;
+				std::memcpy(e.address, bytes.data(), bytes.size());
+			}
+			commit();
+		}
+
+		// writes the ring to a new file, returns its name or an empty string on failure;
+		// files beyond max_dump_files are removed, oldest first
+		std::string dump()
+		{
+			const auto recorded = head_.load(boost::memory_order_acquire);
+			const auto count = std::min<std::uint64_t>(recorded, mask_ + 1);
+
+			std::ostringstream name;
+			name << file_prefix_ << "_" << std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count()
+				<< "_" << ++dumps_ << ".bin";
+			std::ofstream file(name.str(), std::ios::binary | std::ios::trunc);
+
+			dump_header header;
+			std::memcpy(header.magic, "NBFR", 4);
+			header.version = dump_version;
+			header.event_size = sizeof(event);
+			header.count = static_cast<std::uint32_t>(count);
+			header.recorded = recorded;
+			header.epoch_us = epoch_us_;
+			header.start_ticks = start_ticks_;
+			const auto elapsed_ticks = ticks() - start_ticks_;
+			header.ns_per_tick = elapsed_ticks == 0 ? 1.0 :
+				static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - started_).count()) / elapsed_ticks;
+			file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			// oldest first: the part of the ring after the head, then the part before it
+			const auto first = static_cast<size_t>((recorded - count) & mask_);
+			const auto tail = std::min<size_t>(static_cast<size_t>(count), mask_ + 1 - first);
+			file.write(reinterpret_cast<const char*>(events_.get() + first), sizeof(event) * tail);
+			file.write(reinterpret_cast<const char*>(events_.get()), sizeof(event) * (count - tail));
+			file.close();
+			if (!file)
+			{
+				BOOST_LOG_SEV(logger_, trivial::error) << "Error: Flight recorder dump failed: " << name.str();
+				return std::string();
+			}
+			BOOST_LOG_SEV(logger_, trivial::info) << "Flight recorder dump: " << name.str() << ", " << count << " events";
+			dump_files_.push_back(name.str());
+			while (dump_files_.size() > max_dump_files)
+			{
+				std::remove(dump_files_.front().c_str());
+				dump_files_.pop_front();
+			}
+			return name.str();
+		}
+
+	private:
+		static size_t round_up(unsigned int capacity)
+		{
+			size_t size = 1;
+			while (size < capacity)
+			{
+				size <<= 1;
+			}
+			return size;
+		}
+
+		static std::uint64_t ticks()
+		{
+#if defined(NANO_BALANCER_TSC)
+			return __rdtsc();
+#else
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now().time_since_epoch()).count());
+#endif
+		}
+
+		event& next(std::uint32_t connection, event_kind kind)
+		{
+			auto& e = events_[head_.load(boost::memory_order_relaxed) & mask_];
+			e.ticks = ticks();
+			e.connection = connection;
+			e.kind = kind;
+			return e;
+		}
+
+		void commit()
+		{
+			// single writer, the release orders the event before the new head for a reader on another thread
+			head_.store(head_.load(boost::memory_order_relaxed) + 1, boost::memory_order_release);
+		}
+
+		// the dump of a trigger, the last file while it is less than min_dump_interval_ms old
+		std::string dump_limited()
+		{
+			const auto now = clock_type::now();
+			if (!dump_files_.empty() && now - last_dump_ < std::chrono::milliseconds(min_dump_interval_ms))
+			{
+				return dump_files_.back();
+			}
+			last_dump_ = now;
+			return dump();
+		}
+
+		void wait_signal()
+		{
+			signals_.async_wait(boost::bind(&flight_recorder::handle_signal, shared_from_this(),
+				boost::asio::placeholders::error));
+		}
+
+		void handle_signal(const boost::system::error_code& error)
+		{
+			if (error)
+			{
+				return;
+			}
+			dump_limited();
+			wait_signal();
+		}
+
+		void accept_admin()
+		{
+			admin_.async_accept(admin_socket_, boost::bind(&flight_recorder::handle_admin, shared_from_this(),
+				boost::asio::placeholders::error));
+		}
+
+		// the reply is the dump file name, a recent dump is not repeated
+		void handle_admin(const boost::system::error_code& error)
+		{
+			if (error == boost::asio::error::operation_aborted)
+			{
+				return;
+			}
+			if (!error)
+			{
+				const auto reply = dump_limited() + "\n";
+				boost::system::error_code ec;
+				boost::asio::write(admin_socket_, boost::asio::buffer(reply), ec);
+				admin_socket_.shutdown(boost::asio::socket_base::shutdown_both, ec);
+				admin_socket_.close(ec);
+			}
+			accept_admin();
+		}
+
+		logger_type& logger_;
+		const size_t mask_;
+		std::unique_ptr<event[]> events_;
+		boost::atomic<std::uint64_t> head_;
+		std::uint32_t next_connection_;
+		const clock_type::time_point started_;
+		const std::uint64_t start_ticks_;
+		const std::int64_t epoch_us_;
+		const std::string file_prefix_;
+		unsigned int dumps_;
+		clock_type::time_point last_dump_;
+		std::deque<std::string> dump_files_;
+		boost::asio::signal_set signals_;
+		ip::tcp::acceptor admin_;
+		ip::tcp::socket admin_socket_;
+	};
+
+	// prints a flight recorder dump as per connection timelines, connections in order of their first event
+	class flight_decoder
+	{
+	public:
+		static bool decode(const std::string& file_name, std::ostream& out)
+		{
+			std::ifstream file(file_name, std::ios::binary);
+			flight_recorder::dump_header header;
+			if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, "NBFR", 4) != 0 ||
+				header.version != flight_recorder::dump_version || header.event_size != sizeof(flight_recorder::event))
+			{
+				out << "not a flight recorder dump: " << file_name << "\n";
+				return false;
+			}
+			std::vector<flight_recorder::event> events(header.count);
+			file.read(reinterpret_cast<char*>(events.data()), sizeof(flight_recorder::event) * events.size());
+			events.resize(static_cast<size_t>(file.gcount()) / sizeof(flight_recorder::event));
+
+			out << events.size() << " events of " << header.recorded << " recorded\n";
+			std::vector<std::uint32_t> order;
+			std::map<std::uint32_t, std::vector<const flight_recorder::event*>> connections;
+			for (const auto& e : events)
+			{
+				auto& timeline = connections[e.connection];
+				if (timeline.empty())
+				{
+					order.push_back(e.connection);
+				}
+				timeline.push_back(&e);
+			}
+			for (auto connection : order)
+			{
+				const auto& timeline = connections[connection];
+				out << "\nconnection " << connection << "\n";
+				const auto first_ns = time_ns(header, *timeline.front());
+				for (const auto e : timeline)
+				{
+					const auto ns = time_ns(header, *e);
+					out << "  " << wall_time(header.epoch_us, ns)
+						<< " +" << std::setw(9) << (ns - first_ns) / 1000 << " us  "
+						<< describe(*e) << "\n";
+				}
+			}
+			return true;
+		}
+
+	private:
+		// nanoseconds since the recorder started
+		static std::int64_t time_ns(const flight_recorder::dump_header& header, const flight_recorder::event& e)
+		{
+			return static_cast<std::int64_t>(static_cast<double>(static_cast<std::int64_t>(e.ticks - header.start_ticks)) * header.ns_per_tick);
+		}
+
+		static std::string wall_time(std::int64_t epoch_us, std::int64_t time_ns)
+		{
+			const auto us = epoch_us + time_ns / 1000;
+			const auto seconds = static_cast<std::time_t>(us / 1000000);
+			std::tm utc;
+#if defined(_WIN32)
+			gmtime_s(&utc, &seconds);
+#else
+			gmtime_r(&seconds, &utc);
+#endif
+			std::ostringstream text;
+			text << std::put_time(&utc, "%Y-%m-%d %H:%M:%S") << "." << std::setw(6) << std::setfill('0') << us % 1000000;
+			return text.str();
+		}
+
+		static std::string endpoint(const flight_recorder::event& e)
+		{
+			std::ostringstream text;
+			if (e.detail == 6)
+			{
+				ip::address_v6::bytes_type bytes;
+				std::memcpy(bytes.data(), e.address, bytes.size());
+				text << "[" << ip::address_v6(bytes) << "]:" << e.port;
+			}
+			else
+			{
+				ip::address_v4::bytes_type bytes;
+				std::memcpy(bytes.data(), e.address, bytes.size());
+				text << ip::address_v4(bytes) << ":" << e.port;
+			}
+			return text.str();
+		}
+
+		static std::string describe(const flight_recorder::event& e)
+		{
+			static const char* reasons[] = { "closed by peer", "error", "rejected", "no backend", "no source address",
+				"bind failed", "connect failed", "handshake failed", "PROXY header failed" };
+			std::ostringstream text;
+			switch (e.kind)
+			{
+			case flight_recorder::accepted: text << "accepted " << endpoint(e); break;
+			case flight_recorder::backend_chosen: text << "backend " << endpoint(e); break;
+			case flight_recorder::connect_started: text << "connect started"; break;
+			case flight_recorder::connected: text << "connected"; break;
+			case flight_recorder::handshake_done: text << "TLS handshake done"; break;
+			case flight_recorder::first_byte: text << "first byte " << (e.detail == 0 ? "to backend" : "to client"); break;
+			case flight_recorder::byte_totals: text << "bytes to backend " << e.values[0] << ", to client " << e.values[1]; break;
+			case flight_recorder::closed:
+				text << "closed: " << (e.detail < flight_recorder::close_reasons ? reasons[e.detail] : "unknown");
+				if (e.values[0] != 0)
+				{
+					text << " (" << static_cast<std::int64_t>(e.values[0]) << ")";
+				}
+				break;
+			default: text << "unknown event " << static_cast<unsigned int>(e.kind); break;
+			}
+			return text.str();
+		}
+	};
+}
@@ -0,0 +1,481 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unordered_map>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include "types.h"
+#include "client_key.hpp"
+#include "logging.h"
+
+namespace nano_balancer
+{
+	namespace ip = boost::asio::ip;
+
+	// Shares backend health between balancer instances over UDP, to a multicast group or a list of peers.
+	// Every backend has one health record versioned by (version, origin instance): an instance that
+	// observes a change publishes the record with the next version, the highest version wins everywhere
+	// and equal versions are ordered by origin. Changes are sent at once, the full table every second.
+	// Each backend is probed by one live instance only, picked by rendezvous hashing over the instances heard from.
+	// With a shared key every datagram carries a SipHash-2-4 tag and untagged ones are dropped; a group needs the key,
+	// a peer list also drops datagrams from addresses not on the list. Each datagram carries the sender's wall clock
+	// in ms, strictly increasing per instance and covered by the tag: datagrams older than replay_window_ms or not newer
+	// than the last one of their instance are dropped, so a captured datagram cannot keep a dead instance alive.
+	class health_gossip : public boost::enable_shared_from_this<health_gossip>
+	{
+	public:
+		typedef boost::shared_ptr<health_gossip> ptr_type;
+		// health of a backend changed by another instance
+		typedef boost::function<void(const ip_node_type& node, bool healthy)> apply_function;
+
+		enum definitions
+		{
+			magic_value = 0x4748424E, // "NBHG"
+			version_value = 2,
+			header_size = 24,
+			record_size = 40,
+			mac_size = 8,
+			max_datagram = 1400,
+			max_records = (max_datagram - header_size - mac_size) / record_size,
+			sync_period_ms = 1000,
+			// instances not heard from for this long stop probing their share
+			peer_timeout_ms = 3500,
+			// accepted clock difference between instances, and how long the last timestamp of an instance is kept
+			replay_window_ms = 30000
+		};
+
+		health_gossip(logger_type& logger, boost::asio::io_service& ios, const ip::address& local_address,
+			unsigned short port, const std::vector<ip::udp::endpoint>& peers, const std::string& key, apply_function apply) :
+			logger_(logger),
+			socket_(ios),
+			sync_timer_(ios),
+			peers_(peers),
+			apply_(apply),
+			instance_(random_instance()),
+			keyed_(!key.empty()),
+			multicast_(!peers_.empty() && peers_.front().address().is_multicast()),
+			bad_tags_(0),
+			last_sent_(0)
+		{
+			if (multicast_ && !keyed_)
+			{
+				throw std::invalid_argument("gossip to a multicast group needs gossip_key");
+			}
+			// the 128 bit SipHash key is derived from the key text
+			key_[0] = siphash(0, 0, reinterpret_cast<const unsigned char*>(key.data()), key.size());
+			key_[1] = siphash(key_[0], 1, reinterpret_cast<const unsigned char*>(key.data()), key.size());
+
+			const auto v6 = !peers_.empty() && peers_.front().address().is_v6();
+			socket_.open(v6 ? ip::udp::v6() : ip::udp::v4());
+			socket_.set_option(ip::udp::socket::reuse_address(true));
+			if (multicast_)
+			{
+				// every instance binds the group port, the listener address picks the interface
+				socket_.bind(ip::udp::endpoint(v6 ? ip::address(ip::address_v6::any()) : ip::address(ip::address_v4::any()), port));
+				if (v6 || !local_address.is_v4() || local_address.to_v4().is_unspecified())
+				{
+					socket_.set_option(ip::multicast::join_group(peers_.front().address()));
+				}
+				else
+				{
+					socket_.set_option(ip::multicast::join_group(peers_.front().address().to_v4(), local_address.to_v4()));
+					socket_.set_option(ip::multicast::outbound_interface(local_address.to_v4()));
+				}
+				socket_.set_option(ip::multicast::enable_loopback(true));
+			}
+			else
+			{
+				socket_.bind(ip::udp::endpoint(local_address, port));
+			}
+			BOOST_LOG_SEV(logger_, trivial::info) << "Health gossip: instance " << std::hex << instance_ << std::dec
+				<< ", port " << port << ", " << peers_.size() << (multicast_ ? " group" : " peers") << (keyed_ ? ", keyed" : "");
+		}
+
+		void start()
+		{
+			receive();
+			on_sync_timer(boost::system::error_code());
+		}
+
+		// publishes a local observation, sent to the peers right away when it changes the shared state
+		void publish(const ip_node_type& node, bool healthy)
+		{
+			auto& record = records_[node.hash];
+			if (record.version > 0 && record.healthy == healthy)
+			{
+				return;
+			}
+			record.node = node;
+			record.healthy = healthy;
+			++record.version;
+			record.origin = instance_;
+			const record_type* changed = &record;
+			send_records(&changed, 1);
+		}
+
+		// true if this instance probes the node, the live instance with the highest rendezvous hash does
+		bool owns(const ip_node_type& node)
+		{
+			const auto now = clock_type::now();
+			auto best = rendezvous(instance_, node);
+			// peers_seen_ is pruned by the sync timer, entries may still be up to a period past the timeout
+			for (const auto& peer : peers_seen_)
+			{
+				if (now - peer.second < std::chrono::milliseconds(peer_timeout_ms) && rendezvous(peer.first, node) > best)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+	private:
+		typedef std::chrono::steady_clock clock_type;
+
+		struct record_type
+		{
+			ip_node_type node;
+			bool healthy;
+			std::uint64_t version;
+			std::uint64_t origin;
+
+			record_type() : healthy(false), version(0), origin(0)
+			{
+			}
+		};
+
+		static std::uint64_t random_instance()
+		{
+			std::random_device device;
+			std::uint64_t instance = 0;
+			while (instance == 0)
+			{
+				instance = (static_cast<std::uint64_t>(device()) << 32) | device();
+			}
+			return instance;
+		}
+
+		static std::uint64_t rendezvous(std::uint64_t instance, const ip_node_type& node)
+		{
+			return client_hash(instance ^ client_hash(node.hash + 1));
+		}
+
+		void on_sync_timer(const boost::system::error_code& error)
+		{
+			if (error)
+			{
+				return;
+			}
+			prune_peers();
+			// anti-entropy: the whole table, also tells the peers this instance is alive
+			std::vector<const record_type*> all;
+			all.reserve(records_.size());
+			for (const auto& r : records_)
+			{
+				all.push_back(&r.second);
+			}
+			size_t sent = 0;
+			do
+			{
+				const auto count = std::min<size_t>(all.size() - sent, max_records);
+				send_records(all.data() + sent, count);
+				sent += count;
+			} while (sent < all.size());
+
+			sync_timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(sync_period_ms)));
+			sync_timer_.async_wait(boost::bind(&health_gossip::on_sync_timer, shared_from_this(), boost::asio::placeholders::error));
+		}
+
+		void send_records(const record_type* const* records, size_t count)
+		{
+			unsigned char* p = send_buffer_;
+			put(p, static_cast<std::uint32_t>(magic_value));
+			put(p, static_cast<std::uint16_t>(version_value));
+			put(p, static_cast<std::uint16_t>(count));
+			put(p, instance_);
+			last_sent_ = std::max(last_sent_ + 1, wall_ms());
+			put(p, last_sent_);
+			for (size_t i = 0; i < count; ++i)
+			{
+				const auto& r = *records[i];
+				std::memset(p, 0, 16);
+				if (r.node.address.is_v6())
+				{
+					const auto bytes = r.node.address.to_v6().to_bytes();
+					std::copy(bytes.begin(), bytes.end(), p);
+				}
+				else
+				{
+					const auto bytes = r.node.address.to_v4().to_bytes();
+					std::copy(bytes.begin(), bytes.end(), p);
+				}
+				p += 16;
+				put(p, static_cast<std::uint16_t>(r.node.port));
+				*p++ = r.node.address.is_v6() ? 1 : 0;
+				*p++ = r.healthy ? 1 : 0;
+				put(p, static_cast<std::uint32_t>(0));
+				put(p, r.version);
+				put(p, r.origin);
+			}
+			if (keyed_)
+			{
+				put(p, siphash(key_[0], key_[1], send_buffer_, p - send_buffer_));
+			}
+			// best effort, a lost datagram is repaired by the next sync
+			boost::system::error_code ec;
+			for (const auto& peer : peers_)
+			{
+				socket_.send_to(boost::asio::buffer(send_buffer_, p - send_buffer_), peer, 0, ec);
+			}
+		}
+
+		void receive()
+		{
+			socket_.async_receive_from(boost::asio::buffer(receive_buffer_), sender_,
+				boost::bind(&health_gossip::handle_receive, shared_from_this(),
+					boost::asio::placeholders::error,
+					boost::asio::placeholders::bytes_transferred));
+		}
+
+		void handle_receive(const boost::system::error_code& error, size_t size)
+		{
+			if (error == boost::asio::error::operation_aborted)
+			{
+				return;
+			}
+			if (!error && accepted_sender())
+			{
+				merge(receive_buffer_, size);
+			}
+			receive();
+		}
+
+		void merge(const unsigned char* p, size_t size)
+		{
+			if (size < header_size || get<std::uint32_t>(p) != magic_value || get<std::uint16_t>(p + 4) != version_value)
+			{
+				return;
+			}
+			const auto count = get<std::uint16_t>(p + 6);
+			const auto sender = get<std::uint64_t>(p + 8);
+			const auto signed_size = header_size + count * static_cast<size_t>(record_size);
+			if (sender == instance_ || size != signed_size + (keyed_ ? mac_size : 0))
+			{
+				return;
+			}
+			if (keyed_ && get<std::uint64_t>(p + signed_size) != siphash(key_[0], key_[1], p, signed_size))
+			{
+				// a misconfigured instance sends every second, logged at powers of two
+				++bad_tags_;
+				if ((bad_tags_ & (bad_tags_ - 1)) == 0)
+				{
+					BOOST_LOG_SEV(logger_, trivial::warning) << "Health gossip: bad tag from " << sender_ << ", " << bad_tags_ << " dropped";
+				}
+				return;
+			}
+			const auto sent = get<std::uint64_t>(p + 16);
+			const auto now_ms = wall_ms();
+			if (sent + replay_window_ms < now_ms || sent > now_ms + replay_window_ms)
+			{
+				return;
+			}
+			auto& last = last_received_[sender];
+			if (sent <= last.first)
+			{
+				return;
+			}
+			last = std::make_pair(sent, clock_type::now());
+			peers_seen_[sender] = last.second;
+
+			p += header_size;
+			for (size_t i = 0; i < count; ++i, p += record_size)
+			{
+				const auto v6 = p[18] != 0;
+				ip::address address;
+				if (v6)
+				{
+					ip::address_v6::bytes_type bytes;
+					std::copy(p, p + bytes.size(), bytes.begin());
+					address = ip::address_v6(bytes);
+				}
+				else
+				{
+					ip::address_v4::bytes_type bytes;
+					std::copy(p, p + bytes.size(), bytes.begin());
+					address = ip::address_v4(bytes);
+				}
+				const ip_node_type node(address, get<std::uint16_t>(p + 16));
+				const auto healthy = p[19] != 0;
+				const auto version = get<std::uint64_t>(p + 24);
+				const auto origin = get<std::uint64_t>(p + 32);
+
+				auto& record = records_[node.hash];
+				if (version < record.version || (version == record.version && origin <= record.origin))
+				{
+					continue;
+				}
+				const auto changed = record.version == 0 || record.healthy != healthy;
+				record.node = node;
+				record.healthy = healthy;
+				record.version = version;
+				record.origin = origin;
+				if (changed)
+				{
+					apply_(node, healthy);
+				}
+			}
+		}
+
+		void prune_peers()
+		{
+			const auto now = clock_type::now();
+			for (auto i = peers_seen_.begin(); i != peers_seen_.end();)
+			{
+				i = now - i->second >= std::chrono::milliseconds(peer_timeout_ms) ? peers_seen_.erase(i) : std::next(i);
+			}
+			// a timestamp is remembered until datagrams that old are rejected by the window anyway
+			for (auto i = last_received_.begin(); i != last_received_.end();)
+			{
+				i = now - i->second.second >= std::chrono::milliseconds(2 * replay_window_ms) ? last_received_.erase(i) : std::next(i);
+			}
+		}
+
+		static std::uint64_t wall_ms()
+		{
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count());
+		}
+
+		// a peer list only takes datagrams from the listed addresses, a group relies on the key
+		bool accepted_sender() const
+		{
+			if (multicast_)
+			{
+				return true;
+			}
+			for (const auto& peer : peers_)
+			{
+				if (peer.address() == sender_.address())
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		static std::uint64_t rotl(std::uint64_t x, int b)
+		{
+			return (x << b) | (x >> (64 - b));
+		}
+
+		static void sip_round(std::uint64_t v[4])
+		{
+			v[0] += v[1];
+			v[1] = rotl(v[1], 13) ^ v[0];
+			v[0] = rotl(v[0], 32);
+			v[2] += v[3];
+			v[3] = rotl(v[3], 16) ^ v[2];
+			v[0] += v[3];
+			v[3] = rotl(v[3], 21) ^ v[0];
+			v[2] += v[1];
+			v[1] = rotl(v[1], 17) ^ v[2];
+			v[2] = rotl(v[2], 32);
+		}
+
+		// SipHash-2-4
+		static std::uint64_t siphash(std::uint64_t k0, std::uint64_t k1, const unsigned char* data, size_t size)
+		{
+			std::uint64_t v[4] = {
+				k0 ^ 0x736f6d6570736575ull,
+				k1 ^ 0x646f72616e646f6dull,
+				k0 ^ 0x6c7967656e657261ull,
+				k1 ^ 0x7465646279746573ull };
+			const auto tail = size & ~static_cast<size_t>(7);
+			for (size_t i = 0; i <= tail; i += 8)
+			{
+				std::uint64_t m = 0;
+				if (i < tail)
+				{
+					for (size_t j = 0; j < 8; ++j)
+					{
+						m |= static_cast<std::uint64_t>(data[i + j]) << (j * 8);
+					}
+				}
+				else
+				{
+					// last word: remaining bytes and the length in the top byte
+					for (size_t j = 0; j < (size & 7); ++j)
+					{
+						m |= static_cast<std::uint64_t>(data[i + j]) << (j * 8);
+					}
+					m |= static_cast<std::uint64_t>(size) << 56;
+				}
+				v[3] ^= m;
+				sip_round(v);
+				sip_round(v);
+				v[0] ^= m;
+			}
+			v[2] ^= 0xff;
+			for (int i = 0; i < 4; ++i)
+			{
+				sip_round(v);
+			}
+			return v[0] ^ v[1] ^ v[2] ^ v[3];
+		}
+
+		// network byte order
+		template <class T>
+		static void put(unsigned char*& p, T value)
+		{
+			for (size_t i = sizeof(T); i > 0; --i)
+			{
+				*p++ = static_cast<unsigned char>(value >> ((i - 1) * 8));
+			}
+		}
+
+		template <class T>
+		static T get(const unsigned char* p)
+		{
+			T value = 0;
+			for (size_t i = 0; i < sizeof(T); ++i)
+			{
+				value = static_cast<T>((value << 8) | p[i]);
+			}
+			return value;
+		}
+
+		logger_type& logger_;
+		ip::udp::socket socket_;
+		boost::asio::deadline_timer sync_timer_;
+		const std::vector<ip::udp::endpoint> peers_;
+		apply_function apply_;
+		const std::uint64_t instance_;
+		const bool keyed_;
+		const bool multicast_;
+		std::uint64_t key_[2];
+		std::uint64_t bad_tags_;
+		std::unordered_map<size_t, record_type> records_;
+		std::unordered_map<std::uint64_t, clock_type::time_point> peers_seen_;
+		// newest sender timestamp per instance and when it arrived
+		std::unordered_map<std::uint64_t, std::pair<std::uint64_t, clock_type::time_point>> last_received_;
+		std::uint64_t last_sent_;
+		ip::udp::endpoint sender_;
+		unsigned char receive_buffer_[max_datagram];
+		unsigned char send_buffer_[max_datagram];
+	};
+}
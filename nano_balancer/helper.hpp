@@ -5,9 +5,12 @@
 
 #pragma once
 #include <list>
+#include <algorithm>
 #include "types.h"
+#include "options.hpp"
 #include <fstream>
 #include <regex>
+#include <boost/tokenizer.hpp>
 #include "logging.h"
 
 namespace nano_balancer
@@ -28,7 +31,8 @@ namespace nano_balancer
 			return result;
 		}
 
-		static std::list<ip_node_type> parse_config(logger_type& lg, const std::string& config_file_name)
+		// ip:port, [ipv6]:port and host:port lines, host names are returned separately for the resolver
+		static std::list<ip_node_type> parse_config(logger_type& lg, const std::string& config_file_name, std::list<host_name_type>& host_names)
 		{
 			std::list<ip_node_type> result;
 			std::ifstream file(config_file_name);
@@ -36,14 +40,21 @@ namespace nano_balancer
 			while (std::getline(file, line))
 			{
 				try {
-					std::regex re("^((?:(?:[0-9]{1,3}\\.){3})[0-9]{1,3}):([0-9]{1,5})$");
+					std::regex re("^(?:\\[([0-9A-Fa-f:.]+)\\]|((?:(?:[0-9]{1,3}\\.){3})[0-9]{1,3})|([A-Za-z0-9](?:[A-Za-z0-9.-]*[A-Za-z0-9])?)):([0-9]{1,5})$");
 					std::smatch match;
-					if (std::regex_search(line, match, re) && match.size() > 2)
+					if (std::regex_search(line, match, re) && match.size() > 4)
 					{
-						auto address_str = match.str(1);
-						auto port_str = match.str(2);
-						ip_node_type n(boost::asio::ip::address_v4::from_string(address_str), std::stoi(port_str));
-						result.push_back(n);
+						const auto port = static_cast<unsigned short>(std::stoi(match.str(4)));
+						if (match[3].matched)
+						{
+							host_names.emplace_back(match.str(3), port);
+						}
+						else
+						{
+							auto address_str = match[1].matched ? match.str(1) : match.str(2);
+							ip_node_type n(boost::asio::ip::address::from_string(address_str), port);
+							result.push_back(n);
+						}
 					}
 					else
 					{
@@ -54,8 +65,215 @@ namespace nano_balancer
 				{
 					BOOST_LOG_SEV(lg, trivial::error) << "Error: " << e.what();
 				}
+				catch (boost::system::system_error& e)
+				{
+					BOOST_LOG_SEV(lg, trivial::error) << "Error: Config line skipped: " << line << ", " << e.what();
+				}
 			}
 			return result;
-		}		
+		}
+
+		// ip:port or [ipv6]:port
+		template <class Protocol>
+		static typename Protocol::endpoint parse_endpoint(const std::string& endpoint)
+		{
+			const auto colon = endpoint.rfind(':');
+			if (colon == std::string::npos)
+			{
+				throw std::invalid_argument("expected ip:port");
+			}
+			auto address = endpoint.substr(0, colon);
+			if (address.size() > 2 && address.front() == '[' && address.back() == ']')
+			{
+				address = address.substr(1, address.size() - 2);
+			}
+			return typename Protocol::endpoint(boost::asio::ip::address::from_string(address),
+				static_cast<unsigned short>(std::stoul(endpoint.substr(colon + 1))));
+		}
+
+		static balancer_options parse_options(logger_type& lg, int argc, char* argv[], int first)
+		{
+			balancer_options result;
+			for (auto i = first; i < argc; ++i)
+			{
+				const std::string arg = argv[i];
+				const auto pos = arg.find('=');
+				const auto key = arg.substr(0, pos);
+				const auto value = pos == std::string::npos ? std::string() : arg.substr(pos + 1);
+				try
+				{
+					if (key == "source_ips")
+					{
+						boost::char_separator<char> sep(",");
+						boost::tokenizer<boost::char_separator<char>> tok(value, sep);
+						for (auto address : tok)
+						{
+							result.source_addresses.push_back(boost::asio::ip::address::from_string(address));
+						}
+					}
+					else if (key == "source_ports")
+					{
+						result.source_ports = std::stoul(value);
+					}
+					else if (key == "proxy_protocol")
+					{
+						if (value == "v1") result.proxy_version = proxy_protocol::v1;
+						else if (value == "v2") result.proxy_version = proxy_protocol::v2;
+						else throw std::invalid_argument("expected v1 or v2");
+					}
+					else if (key == "affinity_ttl")
+					{
+						result.affinity_ttl = std::stoul(value);
+					}
+					else if (key == "affinity_entries")
+					{
+						result.affinity_entries = std::stoul(value);
+					}
+					else if (key == "count_bytes")
+					{
+						result.count_bytes = std::stoi(value) != 0;
+					}
+					else if (key == "connection_rate")
+					{
+						result.connection_rate = std::stod(value);
+					}
+					else if (key == "client_rate")
+					{
+						result.client_rate = std::stod(value);
+					}
+					else if (key == "listener_rate")
+					{
+						result.listener_rate = std::stod(value);
+					}
+					else if (key == "client_connect_rate")
+					{
+						result.client_connect_rate = std::stod(value);
+					}
+					else if (key == "client_entries")
+					{
+						result.client_entries = std::stoul(value);
+					}
+					else if (key == "tap_file")
+					{
+						result.tap_file = value;
+					}
+					else if (key == "mirror")
+					{
+						boost::char_separator<char> sep(",");
+						boost::tokenizer<boost::char_separator<char>> tok(value, sep);
+						for (auto endpoint : tok)
+						{
+							result.mirror_endpoints.emplace_back(parse_endpoint<boost::asio::ip::tcp>(endpoint));
+						}
+					}
+					else if (key == "mirror_rate")
+					{
+						result.mirror_rate = std::stod(value);
+					}
+					else if (key == "mirror_queue")
+					{
+						result.mirror_queue = std::stoul(value);
+					}
+					else if (key == "stats")
+					{
+						result.stats = std::stoi(value) != 0;
+					}
+					else if (key == "monitor")
+					{
+						result.monitor = std::stoi(value) != 0;
+					}
+					else if (key == "slow_handler_us")
+					{
+						result.slow_handler_us = std::stoul(value);
+					}
+					else if (key == "monitor_report_sec")
+					{
+						result.monitor_report_sec = std::stoul(value);
+					}
+					else if (key == "resolve_ttl")
+					{
+						result.resolve_ttl = std::max(1ul, std::stoul(value));
+					}
+					else if (key == "tls_cert")
+					{
+						result.tls_cert = value;
+					}
+					else if (key == "tls_key")
+					{
+						result.tls_key = value;
+					}
+					else if (key == "tls_session_cache")
+					{
+						result.tls_session_cache = std::stoul(value);
+					}
+					else if (key == "tls_handshake_sec")
+					{
+						result.tls_handshake_sec = std::max(1ul, std::stoul(value));
+					}
+					else if (key == "udp")
+					{
+						result.udp = std::stoi(value) != 0;
+					}
+					else if (key == "udp_idle_sec")
+					{
+						result.udp_idle_sec = std::max(1ul, std::stoul(value));
+					}
+					else if (key == "udp_max_flows")
+					{
+						result.udp_max_flows = std::max(1ul, std::stoul(value));
+					}
+					else if (key == "slow_start_sec")
+					{
+						result.slow_start_sec = std::stoul(value);
+					}
+					else if (key == "slow_start_latency_us")
+					{
+						result.slow_start_latency_us = std::stoul(value);
+					}
+					else if (key == "gossip")
+					{
+						boost::char_separator<char> sep(",");
+						boost::tokenizer<boost::char_separator<char>> tok(value, sep);
+						for (auto endpoint : tok)
+						{
+							result.gossip_endpoints.emplace_back(parse_endpoint<boost::asio::ip::udp>(endpoint));
+						}
+					}
+					else if (key == "gossip_port")
+					{
+						result.gossip_port = static_cast<unsigned short>(std::stoul(value));
+					}
+					else if (key == "gossip_key")
+					{
+						result.gossip_key = value;
+					}
+					else if (key == "recorder_events")
+					{
+						result.recorder_events = std::stoul(value);
+					}
+					else if (key == "recorder_port")
+					{
+						result.recorder_port = static_cast<unsigned short>(std::stoul(value));
+					}
+					else if (key == "recorder_file")
+					{
+						result.recorder_file = value;
+					}
+					else if (key == "stats_port")
+					{
+						result.stats_port = static_cast<unsigned short>(std::stoul(value));
+					}
+					else
+					{
+						BOOST_LOG_SEV(lg, trivial::error) << "Error: Unknown option skipped: " << arg;
+					}
+				}
+				catch (std::exception& e)
+				{
+					BOOST_LOG_SEV(lg, trivial::error) << "Error: Option skipped: " << arg << ", " << e.what();
+				}
+			}
+			return result;
+		}
 	};
 };
\ No newline at end of file
@@ -0,0 +1,160 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <list>
+#include <set>
+#include <string>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include "types.h"
+#include "logging.h"
+
+namespace nano_balancer
+{
+	namespace ip = boost::asio::ip;
+
+	// Keeps the backends of host name config entries up to date.
+	// Names are resolved with asio's async resolver, getaddrinfo runs on asio's private resolver thread,
+	// so the io_service thread that accepts and selects never waits on DNS. Resolved addresses are cached
+	// for the TTL, a failed lookup keeps the last known addresses and is retried sooner.
+	// Every address change is reported as the backends added and removed, on the io_service thread.
+	class host_resolver : public boost::enable_shared_from_this<host_resolver>
+	{
+	public:
+		typedef boost::shared_ptr<host_resolver> ptr_type;
+		typedef boost::function<void(const std::list<ip_node_type>& added, const std::list<ip_node_type>& removed)> update_function;
+
+		enum definitions
+		{
+			check_period_ms = 1000,
+			max_retry_sec = 5
+		};
+
+		host_resolver(logger_type& logger, boost::asio::io_service& ios, const std::list<host_name_type>& host_names,
+			unsigned int ttl_sec, update_function update) :
+			logger_(logger),
+			resolver_(ios),
+			timer_(ios),
+			ttl_(boost::posix_time::seconds(ttl_sec)),
+			retry_(boost::posix_time::seconds(std::min<unsigned int>(ttl_sec, max_retry_sec))),
+			update_(update)
+		{
+			for (const auto& host_name : host_names)
+			{
+				hosts_.emplace_back(host_name);
+			}
+			BOOST_LOG_SEV(logger_, trivial::info) << "Host names: " << hosts_.size() << ", resolved every " << ttl_sec << " sec";
+		}
+
+		void start()
+		{
+			on_timer(boost::system::error_code());
+		}
+
+	private:
+		struct host_entry
+		{
+			host_name_type host_name;
+			std::set<ip::address> addresses;
+			boost::posix_time::ptime expires;
+			bool pending;
+
+			explicit host_entry(const host_name_type& host_name) :
+				host_name(host_name),
+				pending(false)
+			{
+			}
+		};
+
+		void on_timer(const boost::system::error_code& error)
+		{
+			if (error)
+			{
+				return;
+			}
+			const auto now = boost::posix_time::microsec_clock::universal_time();
+			for (auto& host : hosts_)
+			{
+				if (!host.pending && (host.expires.is_not_a_date_time() || host.expires <= now))
+				{
+					resolve(host);
+				}
+			}
+			timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(check_period_ms)));
+			timer_.async_wait(boost::bind(&host_resolver::on_timer, shared_from_this(), boost::asio::placeholders::error));
+		}
+
+		void resolve(host_entry& host)
+		{
+			host.pending = true;
+			resolver_.async_resolve(host.host_name.name, std::to_string(host.host_name.port),
+				boost::bind(&host_resolver::handle_resolve,
+					shared_from_this(),
+					boost::asio::placeholders::error,
+					boost::asio::placeholders::results,
+					&host));
+		}
+
+		void handle_resolve(const boost::system::error_code& error, ip::tcp::resolver::results_type results, host_entry* host)
+		{
+			host->pending = false;
+			const auto now = boost::posix_time::microsec_clock::universal_time();
+			if (error)
+			{
+				BOOST_LOG_SEV(logger_, trivial::error) << "Error: Resolve failed: " << host->host_name.name << ", " << error.message()
+					<< " (keeping " << host->addresses.size() << " addresses)";
+				host->expires = now + retry_;
+				return;
+			}
+			host->expires = now + ttl_;
+
+			std::set<ip::address> addresses;
+			for (const auto& entry : results)
+			{
+				addresses.insert(entry.endpoint().address());
+			}
+
+			std::list<ip_node_type> added;
+			std::list<ip_node_type> removed;
+			for (const auto& address : addresses)
+			{
+				if (host->addresses.find(address) == host->addresses.end())
+				{
+					added.emplace_back(address, host->host_name.port);
+				}
+			}
+			for (const auto& address : host->addresses)
+			{
+				if (addresses.find(address) == addresses.end())
+				{
+					removed.emplace_back(address, host->host_name.port);
+				}
+			}
+			if (added.empty() && removed.empty())
+			{
+				return;
+			}
+
+			BOOST_LOG_SEV(logger_, trivial::info) << "Resolved: " << host->host_name.name << ":" << host->host_name.port
+				<< ", " << addresses.size() << " addresses, " << added.size() << " added, " << removed.size() << " removed";
+			host->addresses.swap(addresses);
+			update_(added, removed);
+		}
+
+		logger_type& logger_;
+		ip::tcp::resolver resolver_;
+		boost::asio::deadline_timer timer_;
+		const boost::posix_time::time_duration ttl_;
+		const boost::posix_time::time_duration retry_;
+		update_function update_;
+		// list keeps entry addresses stable for the pending handlers
+		std::list<host_entry> hosts_;
+	};
+}
@@ -0,0 +1,287 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include "logging.h"
+
+namespace nano_balancer
+{
+	enum handler_kind
+	{
+		accept_handler,
+		connect_handler,
+		read_handler,
+		write_handler,
+		probe_handler,
+		handler_kinds
+	};
+
+	// log2 histogram of microseconds, bucket i counts [2^(i-1), 2^i) us
+	class latency_histogram
+	{
+	public:
+		enum definitions
+		{
+			bucket_count = 32
+		};
+
+		latency_histogram()
+		{
+			reset();
+		}
+
+		void record(std::uint64_t us)
+		{
+			size_t index = 0;
+			while (us && index < bucket_count - 1)
+			{
+				us >>= 1;
+				++index;
+			}
+			buckets_[index].fetch_add(1, boost::memory_order_relaxed);
+		}
+
+		// moves the counts into a plain snapshot and starts over
+		void take(std::uint64_t (&snapshot)[bucket_count])
+		{
+			for (size_t i = 0; i < bucket_count; ++i)
+			{
+				snapshot[i] = buckets_[i].exchange(0, boost::memory_order_relaxed);
+			}
+		}
+
+		void reset()
+		{
+			for (auto& b : buckets_)
+			{
+				b = 0;
+			}
+		}
+
+		// upper bound in us of the bucket holding the percentile, 0 if empty
+		static std::uint64_t percentile(const std::uint64_t (&snapshot)[bucket_count], double p)
+		{
+			std::uint64_t total = 0;
+			for (auto c : snapshot) total += c;
+			if (total == 0)
+			{
+				return 0;
+			}
+			const auto target = std::min(total - 1, static_cast<std::uint64_t>(total * p));
+			std::uint64_t seen = 0;
+			for (size_t i = 0; i < bucket_count; ++i)
+			{
+				seen += snapshot[i];
+				if (seen > target)
+				{
+					return 1ull << i;
+				}
+			}
+			return 1ull << (bucket_count - 1);
+		}
+
+		static std::uint64_t count(const std::uint64_t (&snapshot)[bucket_count])
+		{
+			std::uint64_t total = 0;
+			for (auto c : snapshot) total += c;
+			return total;
+		}
+
+	private:
+		boost::atomic<std::uint64_t> buckets_[bucket_count];
+	};
+
+	// Measures event loop scheduling lag with a periodic timer and handler execution time per handler kind.
+	// Handlers and lag over the threshold are counted, with the worst seen, and logged with the periodic report:
+	// a warning written from the handler would itself stall the loop on the synchronous log sink.
+	class loop_monitor : public boost::enable_shared_from_this<loop_monitor>
+	{
+	public:
+		typedef boost::shared_ptr<loop_monitor> ptr_type;
+		typedef std::chrono::steady_clock clock_type;
+
+		enum definitions
+		{
+			lag_period_ms = 100
+		};
+
+		// times the enclosing handler body, does nothing without a monitor
+		class scope
+		{
+			loop_monitor* monitor_;
+			handler_kind kind_;
+			clock_type::time_point started_;
+		public:
+			scope(loop_monitor* monitor, handler_kind kind) :
+				monitor_(monitor),
+				kind_(kind)
+			{
+				if (monitor_)
+				{
+					started_ = clock_type::now();
+				}
+			}
+			~scope()
+			{
+				if (monitor_)
+				{
+					monitor_->record(kind_, clock_type::now() - started_);
+				}
+			}
+		};
+
+		// handler wrapper timing every invocation
+		template <class Handler>
+		class timed_handler
+		{
+			loop_monitor* monitor_;
+			handler_kind kind_;
+			Handler handler_;
+		public:
+			timed_handler(loop_monitor* monitor, handler_kind kind, Handler handler) :
+				monitor_(monitor),
+				kind_(kind),
+				handler_(std::move(handler))
+			{
+			}
+
+			template <class... Args>
+			void operator()(Args&&... args)
+			{
+				scope timing(monitor_, kind_);
+				handler_(std::forward<Args>(args)...);
+			}
+		};
+
+		loop_monitor(logger_type& logger, boost::asio::io_service& ios, unsigned int threshold_us, unsigned int report_sec) :
+			logger_(logger),
+			threshold_us_(threshold_us),
+			report_period_(std::chrono::seconds(report_sec)),
+			lag_timer_(ios),
+			slow_lags_(0),
+			worst_lag_us_(0)
+		{
+			std::fill(std::begin(slow_handlers_), std::end(slow_handlers_), 0);
+			std::fill(std::begin(worst_handler_us_), std::end(worst_handler_us_), 0);
+		}
+
+		void start()
+		{
+			last_report_ = clock_type::now();
+			expected_ = clock_type::now() + std::chrono::milliseconds(lag_period_ms);
+			lag_timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(lag_period_ms)));
+			lag_timer_.async_wait(boost::bind(&loop_monitor::on_lag_timer, shared_from_this(), boost::asio::placeholders::error));
+		}
+
+		template <class Handler>
+		timed_handler<Handler> wrap(handler_kind kind, Handler handler)
+		{
+			return timed_handler<Handler>(this, kind, std::move(handler));
+		}
+
+		void record(handler_kind kind, clock_type::duration elapsed)
+		{
+			const auto us = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+			handlers_[kind].record(us);
+			if (us > threshold_us_)
+			{
+				++slow_handlers_[kind];
+				worst_handler_us_[kind] = std::max(worst_handler_us_[kind], us);
+			}
+		}
+
+	private:
+		void on_lag_timer(const boost::system::error_code& error)
+		{
+			if (error)
+			{
+				return;
+			}
+			const auto now = clock_type::now();
+			const auto lag_us = static_cast<std::uint64_t>(std::max<std::int64_t>(0,
+				std::chrono::duration_cast<std::chrono::microseconds>(now - expected_).count()));
+			lag_.record(lag_us);
+			if (lag_us > threshold_us_)
+			{
+				++slow_lags_;
+				worst_lag_us_ = std::max(worst_lag_us_, lag_us);
+			}
+
+			if (now - last_report_ >= report_period_)
+			{
+				last_report_ = now;
+				report();
+			}
+
+			expected_ = now + std::chrono::milliseconds(lag_period_ms);
+			lag_timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(lag_period_ms)));
+			lag_timer_.async_wait(boost::bind(&loop_monitor::on_lag_timer, shared_from_this(), boost::asio::placeholders::error));
+		}
+
+		void report()
+		{
+			std::uint64_t snapshot[latency_histogram::bucket_count];
+			lag_.take(snapshot);
+			BOOST_LOG_SEV(logger_, trivial::info) << "Loop lag: p50 " << latency_histogram::percentile(snapshot, 0.5)
+				<< " us, p99 " << latency_histogram::percentile(snapshot, 0.99)
+				<< " us, max " << latency_histogram::percentile(snapshot, 1.0) << " us";
+			if (slow_lags_ > 0)
+			{
+				BOOST_LOG_SEV(logger_, trivial::warning) << "Event loop lag: " << slow_lags_ << " times over " << threshold_us_
+					<< " us, worst " << worst_lag_us_ << " us";
+				slow_lags_ = 0;
+				worst_lag_us_ = 0;
+			}
+			for (auto kind = 0; kind < handler_kinds; ++kind)
+			{
+				if (slow_handlers_[kind] > 0)
+				{
+					BOOST_LOG_SEV(logger_, trivial::warning) << "Slow handler: " << kind_name(static_cast<handler_kind>(kind)) << ": "
+						<< slow_handlers_[kind] << " over " << threshold_us_ << " us, worst " << worst_handler_us_[kind] << " us";
+					slow_handlers_[kind] = 0;
+					worst_handler_us_[kind] = 0;
+				}
+				handlers_[kind].take(snapshot);
+				const auto count = latency_histogram::count(snapshot);
+				if (count > 0)
+				{
+					BOOST_LOG_SEV(logger_, trivial::info) << "Handler " << kind_name(static_cast<handler_kind>(kind)) << ": " << count
+						<< " calls, p50 " << latency_histogram::percentile(snapshot, 0.5)
+						<< " us, p99 " << latency_histogram::percentile(snapshot, 0.99)
+						<< " us, max " << latency_histogram::percentile(snapshot, 1.0) << " us";
+				}
+			}
+		}
+
+		static const char* kind_name(handler_kind kind)
+		{
+			static const char* names[] = { "accept", "connect", "read", "write", "probe" };
+			return names[kind];
+		}
+
+		logger_type& logger_;
+		const std::uint64_t threshold_us_;
+		const clock_type::duration report_period_;
+		boost::asio::deadline_timer lag_timer_;
+		clock_type::time_point expected_;
+		clock_type::time_point last_report_;
+		latency_histogram lag_;
+		latency_histogram handlers_[handler_kinds];
+		// over the threshold since the last report, counted on the loop thread
+		std::uint64_t slow_lags_;
+		std::uint64_t worst_lag_us_;
+		std::uint64_t slow_handlers_[handler_kinds];
+		std::uint64_t worst_handler_us_[handler_kinds];
+	};
+}
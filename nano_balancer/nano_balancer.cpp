@@ -3,10 +3,14 @@
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 #include <iostream>
+#include <cstring>
+#include <algorithm>
 #include "tunnel_host.hpp"
+#include "udp_host.hpp"
 #include "process_host.hpp"
 #include "probe.hpp"
 #include "helper.hpp"
+#include "flight_recorder.hpp"
 #include <windows.h>
 #include "mdump.h"
 #include "time_stamp_stream.hpp"
@@ -15,6 +19,77 @@
 
 using namespace nano_balancer;
 
+// runs the balancer accept loop with the relay filter picked by filter_selector
+struct balancer_runner
+{
+	logger_type& lg;
+	boost::asio::io_service& ios;
+	const std::string& local_host;
+	unsigned short local_port;
+	boost::function<ip_node_type(const ip::address&)> next_upstream;
+	boost::function<void(const ip_node_type&)> upstream_failed;
+	source_pool::ptr_type sources;
+	const balancer_options& options;
+	balancer_stats& stats;
+	const loop_monitor::ptr_type& monitor;
+	const tls_context::ptr_type& tls;
+	const flight_recorder::ptr_type& recorder;
+
+	template <class Filter>
+	void start()
+	{
+		auto filter_context = boost::make_shared<typename Filter::context_type>(filter_setup{ lg, ios, options, stats, monitor });
+
+		// infinte loop
+		while (true)
+		try
+		{
+			BOOST_LOG_SEV(lg, trivial::info) << "Running tunnel...";
+			typename basic_tunnel<Filter>::tunnel_host acceptor(
+				lg,
+				ios,
+				local_host,
+				local_port,
+				next_upstream,
+				upstream_failed,
+				sources,
+				options.proxy_version,
+				tls,
+				filter_context,
+				stats,
+				recorder
+			);
+			acceptor.run();
+			ios.run();
+		}
+		catch (boost::system::system_error& e)
+		{
+			BOOST_LOG_SEV(lg, trivial::error) << "Error in ios.run(): " << e.what();
+			ios.reset();
+			BOOST_LOG_SEV(lg, trivial::info) << "Reset complete";
+		}
+	}
+
+	// UDP listener mode, the relay filters are TCP only
+	void start_udp()
+	{
+		while (true)
+		try
+		{
+			BOOST_LOG_SEV(lg, trivial::info) << "Running udp host...";
+			udp_host host(lg, ios, local_host, local_port, next_upstream, options.udp_idle_sec, options.udp_max_flows, stats, monitor);
+			host.run();
+			ios.run();
+		}
+		catch (boost::system::system_error& e)
+		{
+			BOOST_LOG_SEV(lg, trivial::error) << "Error in ios.run(): " << e.what();
+			ios.reset();
+			BOOST_LOG_SEV(lg, trivial::info) << "Reset complete";
+		}
+	}
+};
+
 int main(int argc, char* argv[])
 {
 	logging::core::get()->set_filter
@@ -26,18 +101,26 @@ int main(int argc, char* argv[])
 
 	logger_type lg;
 
+	// offline flight recorder dump decoder
+	if (argc == 3 && std::strcmp(argv[1], "--decode") == 0)
+	{
+		return flight_decoder::decode(argv[2], std::cout) ? 0 : 1;
+	}
+
 	MiniDumper dumper("nano_balancer");
 
 	time_stamp_stream stdout_time(std::cout);
 	time_stamp_stream stderr_time(std::cerr);
 
-	if (argc != 2 && argc < 4)
+	// master options are key=value, a child has the local port in their place
+	const auto is_child = argc > 3 && std::strchr(argv[2], '=') == nullptr;
+	if (argc < 2 || (!is_child && argc > 2 && std::strchr(argv[2], '=') == nullptr))
 	{
-		std::cerr << "usage: nano_balancer <master_config>\r\n\t nano_balancer <local host ip> <local port> <config>";
+		std::cerr << "usage: nano_balancer <master_config> [<option>=<value> ...]\r\n\t nano_balancer <local host ip> <local port> <config> [<option>=<value> ...]"
+			"\r\n\t nano_balancer --decode <flight recorder dump>";
 		return 1;
 	}
 
-	const auto is_child = argc > 3;
 	const std::string config_file = argv[is_child ? 3 : 1];
 
 	try
@@ -49,37 +132,88 @@ int main(int argc, char* argv[])
 			const std::string local_host = argv[1];
 
 			std::ostringstream child_log_name;
-			child_log_name << "..\\log\\nano_child_" << local_host << local_port << "_%Y%m%d_%H%M%S.%3N.log";
+			auto log_host = local_host;
+			std::replace(log_host.begin(), log_host.end(), ':', '_');
+			child_log_name << "..\\log\\nano_child_" << log_host << local_port << "_%Y%m%d_%H%M%S.%3N.log";
 
 			add_log_file(child_log_name.str());
 
 			BOOST_LOG_SEV(lg, trivial::info) << "Running as child on: " << local_host << ":" << local_port;
 
+			auto options = helper::parse_options(lg, argc, argv, 4);
+
 			boost::asio::io_service ios;
 
-			auto probe = boost::make_shared<nano_balancer::probe>(lg, ios, config_file);
+			source_pool::ptr_type sources;
+			if (!options.source_addresses.empty())
+			{
+				sources = boost::make_shared<source_pool>(lg, options.source_addresses, options.source_ports);
+			}
+
+			loop_monitor::ptr_type monitor;
+			if (options.monitor)
+			{
+				monitor = boost::make_shared<loop_monitor>(lg, ios, options.slow_handler_us, options.monitor_report_sec);
+				monitor->start();
+			}
+
+			tls_context::ptr_type tls;
+			if (!options.tls_cert.empty())
+			{
+				tls = boost::make_shared<tls_context>(lg, options);
+			}
+
+			flight_recorder::ptr_type recorder;
+			if (options.recorder_events > 0)
+			{
+				recorder = boost::make_shared<flight_recorder>(lg, ios, options.recorder_events,
+					options.recorder_file + "_" + log_host + "_" + std::to_string(local_port));
+				recorder->start(options.recorder_port);
+			}
+
+			auto probe = boost::make_shared<nano_balancer::probe>(lg, ios, config_file, options, monitor, sources);
+			if (!options.gossip_endpoints.empty())
+			{
+				auto gossip = boost::make_shared<health_gossip>(lg, ios, ip::address::from_string(local_host),
+					options.gossip_port != 0 ? options.gossip_port : options.gossip_endpoints.front().port(),
+					options.gossip_endpoints,
+					options.gossip_key,
+					boost::bind(&probe::apply_health, probe, _1, _2));
+				probe->share_health(gossip);
+				gossip->start();
+			}
 			probe->start();
 
-			// infinte loop
-			while (true)
-			try
+			balancer_stats stats;
+			boost::shared_ptr<stats_publisher> publisher;
+			if (options.stats)
+			{
+				publisher = boost::make_shared<stats_publisher>(lg, ios, stats_segment::name(argv[1], argv[2]), stats,
+					boost::bind(&probe::get_backend_stats, probe, _1, _2));
+				publisher->start();
+			}
+
+			balancer_runner runner = {
+				lg,
+				ios,
+				local_host,
+				local_port,
+				boost::bind(&probe::get_next_node, probe->shared_from_this(), _1),
+				boost::bind(&probe::report_failure, probe, _1),
+				sources,
+				options,
+				stats,
+				monitor,
+				tls,
+				recorder
+			};
+			if (options.udp)
 			{
-				BOOST_LOG_SEV(lg, trivial::info) << "Running tunnel...";
-				tunnel::tunnel_host acceptor(
-					lg,
-					ios,
-					local_host,
-					local_port,
-					boost::bind(&probe::get_next_node, probe->shared_from_this())
-				);
-				acceptor.run();
-				ios.run();
+				runner.start_udp();
 			}
-			catch (boost::system::system_error& e)
+			else
 			{
-				BOOST_LOG_SEV(lg, trivial::error) << "Error in ios.run(): " << e.what();
-				ios.reset();
-				BOOST_LOG_SEV(lg, trivial::info) << "Reset complete";
+				filter_selector<>::select(options, runner);
 			}
 		}
 		else
@@ -88,8 +222,9 @@ int main(int argc, char* argv[])
 
 			BOOST_LOG_SEV(lg, trivial::info) << "Running as master: " << config_file;
 			// run as master host process
+			const auto options = helper::parse_options(lg, argc, argv, 2);
 			auto instances = helper::parse_master_config(config_file);
-			auto host = process_host(lg, instances);
+			auto host = process_host(lg, instances, options.stats_port);
 			host.run();
 		}
 	}
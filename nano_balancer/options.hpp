@@ -0,0 +1,109 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <string>
+#include <vector>
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include "proxy_protocol.hpp"
+
+namespace nano_balancer
+{
+	// optional balancer mode settings passed as key=value arguments after the endpoint config
+	struct balancer_options
+	{
+		// local addresses to bind upstream connections to, empty to let the OS choose
+		std::vector<boost::asio::ip::address> source_addresses;
+		// ephemeral ports available per source address and backend, 0 to read from the OS
+		unsigned int source_ports;
+		// PROXY protocol header sent to backends ahead of the client bytes
+		proxy_protocol::version proxy_version;
+		// seconds a client address sticks to its backend, 0 disables client affinity
+		unsigned int affinity_ttl;
+		// client addresses tracked by the affinity table
+		unsigned int affinity_entries;
+		// relay filters: per tunnel byte counts, rate limits (0 unlimited), capture file
+		bool count_bytes;
+		double connection_rate;
+		double client_rate;
+		double listener_rate;
+		double client_connect_rate;
+		unsigned int client_entries;
+		std::string tap_file;
+		// traffic mirroring: shadow endpoints, share of connections mirrored, queued bytes per mirrored connection
+		std::vector<boost::asio::ip::tcp::endpoint> mirror_endpoints;
+		double mirror_rate;
+		unsigned int mirror_queue;
+		// balancer mode: publish counters to a shared memory segment
+		bool stats;
+		// event loop lag and handler latency instrumentation, slow handler threshold and report period
+		bool monitor;
+		unsigned int slow_handler_us;
+		unsigned int monitor_report_sec;
+		// seconds resolved backend host names are cached before they are resolved again
+		unsigned int resolve_ttl;
+		// TLS termination: PEM certificate chain and key (defaults to the certificate file), server session cache entries,
+		// seconds a client has to complete the handshake
+		std::string tls_cert;
+		std::string tls_key;
+		unsigned int tls_session_cache;
+		unsigned int tls_handshake_sec;
+		// UDP listener instead of TCP, seconds a client flow is kept without traffic,
+		// flows open at once (datagrams of new clients are dropped above it)
+		bool udp;
+		unsigned int udp_idle_sec;
+		unsigned int udp_max_flows;
+		// seconds a newly good backend ramps up to its full share of connections (0 disabled),
+		// connect latency in us over which the ramp holds (0 time only)
+		unsigned int slow_start_sec;
+		unsigned int slow_start_latency_us;
+		// shared backend health: multicast group or peer list, local gossip port (0 for the port of the first endpoint),
+		// shared key authenticating the datagrams (required for a group)
+		std::vector<boost::asio::ip::udp::endpoint> gossip_endpoints;
+		unsigned short gossip_port;
+		std::string gossip_key;
+		// flight recorder: ring size in events (0 disabled), loopback port dumping the ring on connect, dump file name prefix
+		unsigned int recorder_events;
+		unsigned short recorder_port;
+		std::string recorder_file;
+		// master mode: local port serving the aggregated counters of all children, 0 disabled
+		unsigned short stats_port;
+
+		balancer_options() :
+			source_ports(0),
+			proxy_version(proxy_protocol::none),
+			affinity_ttl(0),
+			affinity_entries(1 << 20),
+			count_bytes(false),
+			connection_rate(0),
+			client_rate(0),
+			listener_rate(0),
+			client_connect_rate(0),
+			client_entries(1 << 16),
+			mirror_rate(1.0),
+			mirror_queue(1 << 18),
+			stats(false),
+			monitor(false),
+			slow_handler_us(10000),
+			monitor_report_sec(10),
+			resolve_ttl(30),
+			tls_session_cache(20480),
+			tls_handshake_sec(10),
+			udp(false),
+			udp_idle_sec(30),
+			udp_max_flows(65536),
+			slow_start_sec(0),
+			slow_start_latency_us(0),
+			gossip_port(0),
+			recorder_events(1 << 15),
+			recorder_port(0),
+			recorder_file("nano_flight"),
+			stats_port(0)
+		{
+		}
+	};
+};
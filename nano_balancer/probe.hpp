@@ -9,6 +9,15 @@
 #include <boost/thread.hpp>
 #include <boost/lockfree/queue.hpp>
 #include "helper.hpp"
+#include "affinity_table.hpp"
+#include "host_resolver.hpp"
+#include "health_gossip.hpp"
+#include "source_pool.hpp"
+#include "stats.hpp"
+#include "loop_monitor.hpp"
+#include <chrono>
+#include <deque>
+#include <utility>
 #include <unordered_map>
 #include <unordered_set>
 #include "logging.h"
@@ -21,7 +30,17 @@ namespace nano_balancer
 		{
 			queue_capacity = 512,
 			queue_multiplier = 128,
-			probe_period_sec = 5
+			probe_period_sec = 5,
+			// slow start: queue entries of a newly good node (1/16 of the full weight), ramp step
+			slow_start_entries = queue_multiplier / 16,
+			slow_start_step_ms = 250,
+			// ramping nodes are probed every this many steps to follow their connect latency
+			slow_start_probe_steps = 4,
+			// a ramp holds for at most this many slow start windows, then follows time only
+			slow_start_max_hold = 3,
+			// relayed connects that must fail within the window before a node is taken out and the failure is gossiped
+			passive_failures = 3,
+			passive_failure_window_ms = 2000
 		};
 		logger_type& logger_;
 		typedef boost::shared_ptr<boost::thread> thread_t;
@@ -35,41 +54,287 @@ namespace nano_balancer
 		boost::lockfree::queue<size_t> good_nodes_queue;
 		volatile std::atomic<size_t> queue_size;
 
+		// lock-free per node state, indexed by the compact node id
+		struct node_state
+		{
+			boost::atomic<bool> good;
+			boost::atomic<std::uint32_t> latency_us;
+
+			node_state() : good(false), latency_us(0)
+			{
+			}
+		};
+
+		// compact node ids for the affinity table, ids of removed nodes are reused by the next added node
+		std::unordered_map<size_t, std::uint32_t> node_ids;
+		std::vector<size_t> node_hashes;
+		std::deque<node_state> node_states;
+		std::vector<std::uint32_t> free_ids;
+		std::unique_ptr<affinity_table> affinity_;
+		// config entries and resolved host names referencing each member node
+		std::unordered_map<size_t, unsigned int> node_refs;
+		host_resolver::ptr_type resolver_;
+		// backend health shared with other balancer instances, probing is split between them
+		health_gossip::ptr_type gossip_;
+		// recent passive failures per good node: count and start of the window
+		std::unordered_map<size_t, std::pair<unsigned int, std::chrono::steady_clock::time_point>> failures_;
 
 		void add_nodes(std::list<ip_node_type> nodes)
 		{
 			boost::mutex::scoped_lock lock(mutex_);
 			for (auto node : nodes)
 			{
+				if (node_refs[node.hash]++ > 0)
+				{
+					continue;
+				}
 				all_nodes.insert_or_assign(node.hash, node);
+				if (sources_)
+				{
+					sources_->add_node(node);
+				}
+				if (node_ids.find(node.hash) != node_ids.end())
+				{
+					continue;
+				}
+				if (free_ids.empty())
+				{
+					node_ids.emplace(node.hash, static_cast<std::uint32_t>(node_hashes.size()));
+					node_hashes.push_back(node.hash);
+					node_states.emplace_back();
+				}
+				else
+				{
+					// clients still bound to the old node of a reused id are re-routed to the new one
+					const auto id = free_ids.back();
+					free_ids.pop_back();
+					node_ids.emplace(node.hash, id);
+					node_hashes[id] = node.hash;
+				}
 			}
 		}
 
+		// membership changes of resolved host names, called on the io_service thread
+		void update_nodes(const std::list<ip_node_type>& added, const std::list<ip_node_type>& removed)
+		{
+			add_nodes(added);
+			for (auto node : removed)
+			{
+				{
+					boost::mutex::scoped_lock lock(mutex_);
+					auto ref = node_refs.find(node.hash);
+					if (ref == node_refs.end() || --ref->second > 0)
+					{
+						continue;
+					}
+					node_refs.erase(ref);
+				}
+				remove_good_node(node);
+				if (sources_)
+				{
+					sources_->remove_node(node);
+				}
+				boost::mutex::scoped_lock lock(mutex_);
+				all_nodes.erase(node.hash);
+				failures_.erase(node.hash);
+				const auto id = node_ids.find(node.hash);
+				if (id != node_ids.end())
+				{
+					node_states[id->second].latency_us = 0;
+					free_ids.push_back(id->second);
+					node_ids.erase(id);
+				}
+				BOOST_LOG_SEV(logger_, trivial::info) << "\tRemoved: " << node.address << ":" << node.port;
+			}
+		}
+
+		// Slow start: a newly good node enters the round robin queue with a few entries and gets more every step
+		// until it has queue_multiplier, so its share of new connections ramps up over the window.
+		// The ramp only pushes to the lock-free queue, selection stays lock-free.
+		// While the node's connect latency is over the limit the ramp holds, for slow_start_max_hold windows at most.
+		// With shared health only the instance probing the node holds, the others have no fresh latency.
+		struct ramp_state
+		{
+			unsigned int entries;
+			unsigned int steps;
+			boost::posix_time::time_duration elapsed;
+			boost::posix_time::time_duration held;
+		};
+		std::unordered_map<size_t, ramp_state> ramping_;
+		const boost::posix_time::time_duration slow_start_;
+		const std::uint32_t slow_start_latency_us_;
+		boost::asio::deadline_timer ramp_timer_;
+
 		thread_t thread;
 		boost::posix_time::seconds period;
 		boost::asio::deadline_timer probe_timer;
+		loop_monitor::ptr_type monitor_;
+		// source address slots are created as backends are added
+		source_pool::ptr_type sources_;
 
 	public:
 		typedef boost::shared_ptr<probe> ptr_type;
-		probe(logger_type& logger, boost::asio::io_service& ios, const std::string& config_file_name)
+		probe(logger_type& logger, boost::asio::io_service& ios, const std::string& config_file_name, const balancer_options& options,
+			const loop_monitor::ptr_type& monitor = loop_monitor::ptr_type(), const source_pool::ptr_type& sources = source_pool::ptr_type())
 			:
 			logger_(logger),
 			config_name_(config_file_name),
 			io_service(ios),
 			good_nodes_queue(queue_capacity),
 			queue_size(0),
+			slow_start_(boost::posix_time::seconds(options.slow_start_sec)),
+			slow_start_latency_us_(options.slow_start_latency_us),
+			ramp_timer_(ios),
 			period(boost::posix_time::seconds(5)),
-			probe_timer(ios, boost::posix_time::millisec(1))
+			probe_timer(ios, boost::posix_time::millisec(1)),
+			monitor_(monitor),
+			sources_(sources)
 		{
-			add_nodes(helper::parse_config(logger_, config_name_));
+			std::list<host_name_type> host_names;
+			add_nodes(helper::parse_config(logger_, config_name_, host_names));
+			if (!host_names.empty())
+			{
+				resolver_ = boost::make_shared<host_resolver>(logger_, ios, host_names, options.resolve_ttl,
+					boost::bind(&probe::update_nodes, this, _1, _2));
+			}
+			if (options.affinity_ttl > 0)
+			{
+				affinity_.reset(new affinity_table(options.affinity_entries, options.affinity_ttl));
+				BOOST_LOG_SEV(logger_, trivial::info) << "Client affinity: " << affinity_->capacity() << " entries, " << options.affinity_ttl << " sec";
+			}
+			if (options.slow_start_sec > 0)
+			{
+				BOOST_LOG_SEV(logger_, trivial::info) << "Slow start: " << options.slow_start_sec << " sec"
+					<< (slow_start_latency_us_ > 0 ? ", held over " + std::to_string(slow_start_latency_us_) + " us" : std::string());
+			}
 		}
 
 		void start()
 		{
-			// probe_timer.async_wait(boost::bind(&probe::on_timer, shared_from_this(), boost::asio::placeholders::error));
+			probe_timer.async_wait(boost::bind(&probe::on_timer, shared_from_this(), boost::asio::placeholders::error));
+			if (slow_start_.total_seconds() > 0)
+			{
+				ramp_timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(slow_start_step_ms)));
+				ramp_timer_.async_wait(boost::bind(&probe::on_ramp_timer, shared_from_this(), boost::asio::placeholders::error));
+			}
+			if (resolver_)
+			{
+				resolver_->start();
+			}
+		}
+
+		void share_health(const health_gossip::ptr_type& gossip)
+		{
+			gossip_ = gossip;
+		}
+
+		// health published by another instance
+		void apply_health(const ip_node_type& node, bool healthy)
+		{
+			auto member = node;
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				if (all_nodes.find(node.hash) == all_nodes.end())
+				{
+					// not a backend of this config
+					return;
+				}
+			}
+			if (healthy)
+			{
+				add_good_node(member);
+			}
+			else
+			{
+				remove_good_node(member);
+			}
+		}
+
+		// passive failure signal, a relayed connection could not reach the backend;
+		// one refused connect is not enough to take the node out here and on every other instance
+		void report_failure(const ip_node_type& node)
+		{
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				if (good_nodes_set.find(node.hash) == good_nodes_set.end())
+				{
+					return;
+				}
+				const auto now = std::chrono::steady_clock::now();
+				auto& failures = failures_[node.hash];
+				if (failures.first == 0 || now - failures.second > std::chrono::milliseconds(passive_failure_window_ms))
+				{
+					failures = std::make_pair(0u, now);
+				}
+				if (++failures.first < passive_failures)
+				{
+					return;
+				}
+				failures_.erase(node.hash);
+			}
+			auto member = node;
+			remove_good_node(member);
+			if (gossip_)
+			{
+				gossip_->publish(node, false);
+			}
+		}
+
+		ip_node_type get_next_node(const ip::address& client)
+		{
+			if (affinity_)
+			{
+				std::uint32_t id = 0;
+				const auto routed = affinity_->route(
+					client,
+					[this](std::uint32_t id) { return node_states[id].good.load(boost::memory_order_relaxed); },
+					[this](std::uint32_t& id) { return next_good_node(id); },
+					id);
+				if (routed)
+				{
+					return all_nodes.at(node_hashes[id]);
+				}
+			}
+			return get_round_robin_node();
 		}
 
-		ip_node_type get_next_node()
+		// fills the stats segment backend list, called from the stats publisher timer
+		std::uint32_t get_backend_stats(stats_segment::backend* backends, std::uint32_t max_count)
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			std::uint32_t count = 0;
+			// in id order, free ids of removed nodes take no slot
+			for (size_t id = 0; count < max_count && id < node_hashes.size(); ++id)
+			{
+				const auto owner = node_ids.find(node_hashes[id]);
+				if (owner == node_ids.end() || owner->second != id)
+				{
+					continue;
+				}
+				const auto& state = node_states[id];
+				auto& b = backends[count++];
+				std::memset(&b, 0, sizeof(b));
+				const auto& node = all_nodes.at(owner->first);
+				if (node.address.is_v6())
+				{
+					const auto bytes = node.address.to_v6().to_bytes();
+					std::copy(bytes.begin(), bytes.end(), b.address);
+					b.is_v6 = 1;
+				}
+				else
+				{
+					const auto bytes = node.address.to_v4().to_bytes();
+					std::copy(bytes.begin(), bytes.end(), b.address);
+				}
+				b.port = node.port;
+				b.healthy = state.good.load(boost::memory_order_relaxed) ? 1 : 0;
+				b.latency_us = state.latency_us.load(boost::memory_order_relaxed);
+			}
+			return count;
+		}
+
+	protected:
+		ip_node_type get_round_robin_node()
 		{
 			size_t node_hash = 0;
 			if (good_nodes_queue.pop(node_hash))
@@ -80,12 +345,29 @@ namespace nano_balancer
 //				BOOST_LOG_SEV(logger_, trivial::info)  << "\tNext: " << node.address << ":" << node.port;
 				return node;
 			}
+			if (all_nodes.empty())
+			{
+				// host names not resolved yet
+				BOOST_LOG_SEV(logger_, trivial::error) << "Error: No target endpoints";
+				return ip_node_type();
+			}
 			auto node = all_nodes.begin()->second;
 			BOOST_LOG_SEV(logger_, trivial::info)  << "\tFallback: " << node.address << ":" << node.port;
 			return node;
 		}
 
-	protected:
+		bool next_good_node(std::uint32_t& id)
+		{
+			size_t node_hash = 0;
+			if (good_nodes_queue.pop(node_hash))
+			{
+				good_nodes_queue.push(node_hash);
+				id = node_ids.at(node_hash);
+				return true;
+			}
+			return false;
+		}
+
 		void add_good_node(ip_node_type& node)
 		{
 			boost::mutex::scoped_lock lock(mutex_);
@@ -94,11 +376,18 @@ namespace nano_balancer
 			if (good_nodes_set.find(node.hash) == good_nodes_set.end())
 			{
 				good_nodes_set.insert(node.hash);
-				// fill the queue with the good node refs
-				for (auto i = 0; i < queue_multiplier; ++i)
+				node_states[node_ids.at(node.hash)].good = true;
+				failures_.erase(node.hash);
+				// fill the queue with the good node refs, or the first of them when slow starting
+				const unsigned int entries = slow_start_.total_seconds() > 0 ? slow_start_entries : queue_multiplier;
+				for (unsigned int i = 0; i < entries; ++i)
 				{
 					queue_size += good_nodes_queue.push(node.hash) ? 1 : 0;
 				}
+				if (entries < queue_multiplier)
+				{
+					ramping_[node.hash] = ramp_state{ entries, 0, boost::posix_time::time_duration(), boost::posix_time::time_duration() };
+				}
 			}
 			// do nothing if node already in good nodes collections
 		}
@@ -125,21 +414,34 @@ namespace nano_balancer
 						good_nodes_queue.push(hash);
 					}
 				}
-				// remove from the good set
+				// remove from the good set, affinity entries fail over on their next lookup
 				good_nodes_set.erase(node.hash);
+				node_states[node_ids.at(node.hash)].good = false;
+				ramping_.erase(node.hash);
 			}
 		}
 
-		void handle_connect(const boost::system::error_code& error, boost::shared_ptr<socket_type>& socket, ip_node_type& node)
+		void handle_connect(const boost::system::error_code& error, boost::shared_ptr<socket_type>& socket, ip_node_type& node, boost::posix_time::ptime started)
 		{
-			if (!error)
+			loop_monitor::scope timing(monitor_.get(), probe_handler);
+			if (all_nodes.find(node.hash) == all_nodes.end())
+			{
+				// removed while the probe was in flight
+			}
+			else if (!error)
 			{
+				const auto latency = boost::posix_time::microsec_clock::universal_time() - started;
+				node_states[node_ids.at(node.hash)].latency_us = static_cast<std::uint32_t>(latency.total_microseconds());
 				add_good_node(node);
 			}
 			else
 			{
 				remove_good_node(node);
 			}
+			if (gossip_ && all_nodes.find(node.hash) != all_nodes.end())
+			{
+				gossip_->publish(node, !error);
+			}
 			if (socket->is_open())
 			{
 				socket->close();
@@ -158,20 +460,77 @@ namespace nano_balancer
 					shared_from_this(),
 					boost::asio::placeholders::error,
 					socket,
-					node
+					node,
+					boost::posix_time::microsec_clock::universal_time()
 				)
 			);
 		}
 
+		void on_ramp_timer(const boost::system::error_code& error)
+		{
+			if (error)
+			{
+				return;
+			}
+			loop_monitor::scope timing(monitor_.get(), probe_handler);
+			ramp_timer_.expires_at(ramp_timer_.expires_at() + boost::posix_time::milliseconds(static_cast<long>(slow_start_step_ms)));
+			ramp_timer_.async_wait(boost::bind(&probe::on_ramp_timer, shared_from_this(), boost::asio::placeholders::error));
+
+			boost::mutex::scoped_lock lock(mutex_);
+			for (auto i = ramping_.begin(); i != ramping_.end();)
+			{
+				auto& ramp = i->second;
+				const auto& node = all_nodes.at(i->first);
+				const auto step = boost::posix_time::milliseconds(static_cast<long>(slow_start_step_ms));
+				const auto probed = slow_start_latency_us_ > 0 && (!gossip_ || gossip_->owns(node));
+				const auto latency_us = node_states[node_ids.at(i->first)].latency_us.load(boost::memory_order_relaxed);
+				const auto max_hold = slow_start_ * static_cast<int>(slow_start_max_hold);
+				if (!probed || latency_us <= slow_start_latency_us_ || ramp.held >= max_hold)
+				{
+					ramp.elapsed += step;
+				}
+				else if ((ramp.held += step) >= max_hold)
+				{
+					BOOST_LOG_SEV(logger_, trivial::warning) << "\tSlow start hold expired: " << node.address << ":" << node.port
+						<< ", " << latency_us << " us over " << slow_start_latency_us_ << " us for " << ramp.held.total_seconds() << " sec";
+				}
+				const auto progress = std::min<std::int64_t>(ramp.elapsed.total_milliseconds(), slow_start_.total_milliseconds());
+				const auto target = static_cast<unsigned int>(slow_start_entries +
+					(queue_multiplier - slow_start_entries) * progress / slow_start_.total_milliseconds());
+				for (; ramp.entries < target; ++ramp.entries)
+				{
+					queue_size += good_nodes_queue.push(i->first) ? 1 : 0;
+				}
+				if (ramp.entries >= queue_multiplier)
+				{
+					BOOST_LOG_SEV(logger_, trivial::info) << "\tFull weight: " << node.address << ":" << node.port;
+					i = ramping_.erase(i);
+					continue;
+				}
+				if (probed && ramp.held < max_hold && ++ramp.steps % slow_start_probe_steps == 0)
+				{
+					// fresh latency for the hold check, a failed probe ends the ramp
+					auto member = node;
+					do_probe(member);
+				}
+				++i;
+			}
+		}
+
 		void on_timer(const boost::system::error_code& e)
 		{
+			loop_monitor::scope timing(monitor_.get(), probe_handler);
 			probe_timer.expires_at(probe_timer.expires_at() + period);
 			probe_timer.async_wait(boost::bind(&probe::on_timer, shared_from_this(), boost::asio::placeholders::error));
 
 			boost::mutex::scoped_lock lock(mutex_);
 			for (auto pair : all_nodes)
 			{
-				do_probe(pair.second);
+				// with shared health each backend is probed by one instance
+				if (!gossip_ || gossip_->owns(pair.second))
+				{
+					do_probe(pair.second);
+				}
 			}
 		}
 	};
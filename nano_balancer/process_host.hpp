@@ -10,7 +10,9 @@
 #include <boost/token_functions.hpp>
 #include <boost/tokenizer.hpp>
 #include "logging.h"
+#include "stats.hpp"
 #include <boost/thread/thread.hpp>
+#include <boost/asio.hpp>
 
 namespace nano_balancer
 {
@@ -23,6 +25,8 @@ namespace nano_balancer
 		std::list<std::shared_ptr<boost::process::child>> children;
 		std::map<boost::process::pid_t, cmd_line_type> child_l_map;
 		logger_type& logger_;
+		unsigned short stats_port_;
+		boost::thread stats_thread_;
 
 		bool start_new_child(cmd_line_type cmd_line)
 		{
@@ -43,25 +47,156 @@ namespace nano_balancer
 			children.push_back(new_child);
 			return true;			
 		}
-	public:
-		process_host(logger_type& logger, std::list<std::string>& instances)
-		: instances_(instances), logger_(logger)
-	{
+
+		static cmd_line_type parse_cmd_line(const std::string& instance)
+		{
+			boost::char_separator<char> sep(" ");
+			boost::tokenizer<boost::char_separator<char>> tok(instance, sep);
+			cmd_line_type cmd_line;
+			for (auto cs : tok)
+			{
+				cmd_line.push_back(cs);
+			}
+			return cmd_line;
 		}
 
-		void run()
+		// aggregated text view of the children stats segments
+		std::string stats_report(std::vector<std::pair<std::string, std::shared_ptr<stats_reader>>>& readers)
+		{
+			struct backend_total
+			{
+				unsigned int healthy;
+				unsigned int reported;
+				std::uint32_t latency_us;
+			};
+			std::map<std::string, backend_total> backends;
+			std::uint64_t accepted = 0, rejected = 0, closed = 0, connect_failures = 0, bytes_up = 0, bytes_down = 0;
+			std::ostringstream children;
+			const auto now_ms = (boost::posix_time::microsec_clock::universal_time() - boost::posix_time::from_time_t(0)).total_milliseconds();
+			auto segment = std::make_unique<stats_segment>();
+			for (auto& reader : readers)
+			{
+				auto ok = reader.second->read(*segment);
+				if (ok && now_ms - static_cast<long long>(segment->updated_ms) > 2000)
+				{
+					// stale mapping of a restarted child, map the new segment
+					reader.second->reset();
+					ok = reader.second->read(*segment);
+				}
+				if (!ok)
+				{
+					children << "child " << reader.first << " unavailable\n";
+					continue;
+				}
+				const auto& s = *segment;
+				accepted += s.accepted;
+				rejected += s.rejected;
+				closed += s.closed;
+				connect_failures += s.connect_failures;
+				bytes_up += s.bytes_up;
+				bytes_down += s.bytes_down;
+				children << "child " << reader.first << " pid " << s.pid << " accepted " << s.accepted << " active " << s.accepted - s.closed
+					<< " bytes_up " << s.bytes_up << " bytes_down " << s.bytes_down << "\n";
+				for (std::uint32_t i = 0; i < s.backend_count && i < stats_segment::max_backends; ++i)
+				{
+					const auto& b = s.backends[i];
+					std::ostringstream name;
+					if (b.is_v6)
+					{
+						boost::asio::ip::address_v6::bytes_type bytes;
+						std::copy(b.address, b.address + bytes.size(), bytes.begin());
+						name << "[" << boost::asio::ip::address_v6(bytes) << "]:" << b.port;
+					}
+					else
+					{
+						boost::asio::ip::address_v4::bytes_type bytes;
+						std::copy(b.address, b.address + bytes.size(), bytes.begin());
+						name << boost::asio::ip::address_v4(bytes) << ":" << b.port;
+					}
+					auto& total = backends[name.str()];
+					total.healthy += b.healthy;
+					++total.reported;
+					total.latency_us = std::max(total.latency_us, b.latency_us);
+				}
+			}
+
+			std::ostringstream report;
+			report << "accepted " << accepted << "\nrejected " << rejected << "\nactive " << accepted - closed
+				<< "\nconnect_failures " << connect_failures << "\nbytes_up " << bytes_up << "\nbytes_down " << bytes_down << "\n"
+				<< children.str();
+			for (auto& b : backends)
+			{
+				report << "backend " << b.first << " healthy " << b.second.healthy << "/" << b.second.reported
+					<< " max_latency_us " << b.second.latency_us << "\n";
+			}
+			return report.str();
+		}
+
+		// serves the aggregated stats as plain text to every connection on the stats port
+		void run_stats_server()
 		{
+			std::vector<std::pair<std::string, std::shared_ptr<stats_reader>>> readers;
 			for (auto instance : instances_)
 			{
-				boost::char_separator<char> sep(" ");
-				boost::tokenizer<boost::char_separator<char>> tok(instance, sep);
-				cmd_line_type cmd_line;
-				for (auto cs : tok)
+				auto cmd_line = parse_cmd_line(instance);
+				if (cmd_line.size() > 1)
 				{
-					cmd_line.push_back(cs);
+					readers.emplace_back(cmd_line[0] + ":" + cmd_line[1], std::make_shared<stats_reader>(stats_segment::name(cmd_line[0], cmd_line[1])));
 				}
+			}
+
+			try
+			{
+				boost::asio::io_service ios;
+				boost::asio::ip::tcp::acceptor acceptor(ios, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), stats_port_));
+				BOOST_LOG_SEV(logger_, trivial::info) << "Stats on: " << acceptor.local_endpoint();
+				while (true)
+				{
+					boost::asio::ip::tcp::socket socket(ios);
+					boost::system::error_code ec;
+					acceptor.accept(socket, ec);
+					if (ec)
+					{
+						// out of descriptors or an aborted connection, retried after a pause instead of spinning
+						BOOST_LOG_SEV(logger_, trivial::error) << "Error: Stats accept failed: " << ec.message();
+						boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+						continue;
+					}
+					// a failed report ends the connection, not the server
+					try
+					{
+						boost::asio::write(socket, boost::asio::buffer(stats_report(readers)), ec);
+					}
+					catch (std::exception& e)
+					{
+						BOOST_LOG_SEV(logger_, trivial::error) << "Error: Stats report failed: " << e.what();
+					}
+					socket.shutdown(boost::asio::socket_base::shutdown_both, ec);
+					socket.close(ec);
+				}
+			}
+			catch (std::exception& e)
+			{
+				BOOST_LOG_SEV(logger_, trivial::error) << "Error: Stats server failed: " << e.what();
+			}
+		}
 
-				start_new_child(cmd_line);
+	public:
+		process_host(logger_type& logger, std::list<std::string>& instances, unsigned short stats_port = 0)
+		: instances_(instances), logger_(logger), stats_port_(stats_port)
+	{
+		}
+
+		void run()
+		{
+			if (stats_port_)
+			{
+				stats_thread_ = boost::thread(boost::bind(&process_host::run_stats_server, this));
+			}
+
+			for (auto instance : instances_)
+			{
+				start_new_child(parse_cmd_line(instance));
 
 				// boost::this_thread::sleep(boost::posix_time::seconds(1));
 			}
@@ -0,0 +1,118 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <boost/asio.hpp>
+
+namespace nano_balancer
+{
+	namespace ip = boost::asio::ip;
+
+	// PROXY protocol header, see https://www.haproxy.org/download/2.0/doc/proxy-protocol.txt
+	// Headers are formatted into a caller supplied buffer of max_size bytes without allocations.
+	class proxy_protocol
+	{
+	public:
+		enum version
+		{
+			none = 0,
+			v1 = 1,
+			v2 = 2
+		};
+
+		enum definitions
+		{
+			// v1 worst case: "PROXY TCP6 " + 2 * 39 + 2 * 5 + 3 spaces + CRLF
+			max_size = 108
+		};
+
+		static size_t write_header(version ver, const ip::tcp::endpoint& source, const ip::tcp::endpoint& destination, unsigned char* buffer)
+		{
+			auto src = source.address();
+			auto dst = destination.address();
+			// both addresses must be of the same family, map v4 into v6 when mixed
+			if (src.is_v4() != dst.is_v4())
+			{
+				if (src.is_v4()) src = ip::address_v6::v4_mapped(src.to_v4());
+				if (dst.is_v4()) dst = ip::address_v6::v4_mapped(dst.to_v4());
+			}
+			return ver == v2
+				? write_v2(src, source.port(), dst, destination.port(), buffer)
+				: write_v1(src, source.port(), dst, destination.port(), buffer);
+		}
+
+	private:
+		static size_t write_v1(const ip::address& src, unsigned short src_port, const ip::address& dst, unsigned short dst_port, unsigned char* buffer)
+		{
+			char src_str[64], dst_str[64];
+			format_address(src, src_str, sizeof(src_str));
+			format_address(dst, dst_str, sizeof(dst_str));
+			const auto size = std::snprintf(reinterpret_cast<char*>(buffer), max_size, "PROXY %s %s %s %u %u\r\n",
+				src.is_v4() ? "TCP4" : "TCP6", src_str, dst_str, src_port, dst_port);
+			return size > 0 && size < max_size ? size : 0;
+		}
+
+		static size_t write_v2(const ip::address& src, unsigned short src_port, const ip::address& dst, unsigned short dst_port, unsigned char* buffer)
+		{
+			static const unsigned char signature[] = { 0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D, 0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A };
+			auto p = buffer;
+			std::memcpy(p, signature, sizeof(signature));
+			p += sizeof(signature);
+			// version 2, PROXY command
+			*p++ = 0x21;
+			if (src.is_v4())
+			{
+				// AF_INET, STREAM
+				*p++ = 0x11;
+				p = put_short(p, 12);
+				const auto src_bytes = src.to_v4().to_bytes();
+				const auto dst_bytes = dst.to_v4().to_bytes();
+				p = std::copy(src_bytes.begin(), src_bytes.end(), p);
+				p = std::copy(dst_bytes.begin(), dst_bytes.end(), p);
+			}
+			else
+			{
+				// AF_INET6, STREAM
+				*p++ = 0x21;
+				p = put_short(p, 36);
+				const auto src_bytes = src.to_v6().to_bytes();
+				const auto dst_bytes = dst.to_v6().to_bytes();
+				p = std::copy(src_bytes.begin(), src_bytes.end(), p);
+				p = std::copy(dst_bytes.begin(), dst_bytes.end(), p);
+			}
+			p = put_short(p, src_port);
+			p = put_short(p, dst_port);
+			return p - buffer;
+		}
+
+		static unsigned char* put_short(unsigned char* p, unsigned short value)
+		{
+			*p++ = static_cast<unsigned char>(value >> 8);
+			*p++ = static_cast<unsigned char>(value & 0xff);
+			return p;
+		}
+
+		static void format_address(const ip::address& address, char* dest, size_t length)
+		{
+			boost::system::error_code ec;
+			if (address.is_v4())
+			{
+				const auto bytes = address.to_v4().to_bytes();
+				boost::asio::detail::socket_ops::inet_ntop(BOOST_ASIO_OS_DEF(AF_INET), bytes.data(), dest, length, 0, ec);
+			}
+			else
+			{
+				const auto bytes = address.to_v6().to_bytes();
+				boost::asio::detail::socket_ops::inet_ntop(BOOST_ASIO_OS_DEF(AF_INET6), bytes.data(), dest, length, 0, ec);
+			}
+			if (ec)
+			{
+				dest[0] = '\0';
+			}
+		}
+	};
+}
@@ -0,0 +1,206 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <algorithm>
+#include <boost/asio/ip/address.hpp>
+#include "client_key.hpp"
+
+namespace nano_balancer
+{
+	// Token bucket kept as a single "theoretical arrival time" (GCRA), in steady clock nanoseconds.
+	// A bucket is one 64 bit word, so shared buckets are updated with a CAS instead of a lock.
+	class rate_limit
+	{
+	public:
+		rate_limit(double rate, double burst) :
+			interval_ns_(rate > 0 ? 1e9 / rate : 0),
+			tolerance_ns_(rate > 0 ? static_cast<std::int64_t>(burst * 1e9 / rate) : 0)
+		{
+		}
+
+		bool enabled() const
+		{
+			return interval_ns_ > 0;
+		}
+
+		static std::int64_t now()
+		{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		// charges units to a bucket owned by one tunnel, returns nanoseconds to wait before the next charge
+		std::int64_t charge(std::int64_t& tat, std::int64_t now, size_t units) const
+		{
+			tat = std::max(tat, now) + cost(units);
+			return std::max<std::int64_t>(0, tat - now - tolerance_ns_);
+		}
+
+		// charges units to a shared bucket, units already read are always charged
+		std::int64_t charge(std::atomic<std::int64_t>& tat, std::int64_t now, size_t units) const
+		{
+			const auto c = cost(units);
+			auto current = tat.load(std::memory_order_relaxed);
+			std::int64_t next;
+			do
+			{
+				next = std::max(current, now) + c;
+			} while (!tat.compare_exchange_weak(current, next, std::memory_order_relaxed));
+			return std::max<std::int64_t>(0, next - now - tolerance_ns_);
+		}
+
+		// charges units only if they fit the bucket, false otherwise
+		bool admit(std::atomic<std::int64_t>& tat, std::int64_t now, size_t units) const
+		{
+			const auto c = cost(units);
+			auto current = tat.load(std::memory_order_relaxed);
+			std::int64_t next;
+			do
+			{
+				next = std::max(current, now) + c;
+				if (next - now > tolerance_ns_)
+				{
+					return false;
+				}
+			} while (!tat.compare_exchange_weak(current, next, std::memory_order_relaxed));
+			return true;
+		}
+
+	private:
+		std::int64_t cost(size_t units) const
+		{
+			return static_cast<std::int64_t>(std::llround(units * interval_ns_));
+		}
+
+		const double interval_ns_;
+		const std::int64_t tolerance_ns_;
+	};
+
+	// Per client address buckets in a fixed set-associative table, 8 entries per set under one spin lock.
+	// The lock is only taken at accept and close, bytes are charged to the entry with a CAS.
+	// Only idle clients are evicted, the longest unseen first; a set full of active clients charges
+	// the newcomer to the set's shared overflow bucket and counts it as an overflow.
+	class client_limits
+	{
+	public:
+		struct entry
+		{
+			std::uint64_t key;
+			std::atomic<std::int64_t> bytes_tat;
+			std::atomic<std::int64_t> connect_tat;
+			std::uint32_t active;
+			std::uint32_t last_seen;
+		};
+
+	private:
+		enum definitions
+		{
+			set_entries = 8,
+			min_capacity = 1024
+		};
+
+		struct alignas(64) set_type
+		{
+			entry entries[set_entries];
+			// clients that find every entry in use share its bytes and connect limits
+			entry overflow;
+		};
+
+	public:
+		explicit client_limits(size_t capacity) : overflows_(0)
+		{
+			size_t entries = min_capacity;
+			while (entries < capacity)
+			{
+				entries <<= 1;
+			}
+			set_mask_ = entries / set_entries - 1;
+			sets_.reset(new set_type[set_mask_ + 1]());
+			locks_.reset(new std::atomic_flag[set_mask_ + 1]);
+			for (size_t i = 0; i <= set_mask_; ++i)
+			{
+				locks_[i].clear();
+			}
+		}
+
+		// finds or creates the client entry and marks it in use until release(),
+		// the set's overflow entry when every entry is in use by other clients
+		entry* acquire(const ip::address& client, std::int64_t now)
+		{
+			const auto key = client_key(client);
+			const auto index = static_cast<size_t>(client_hash(key) >> 32) & set_mask_;
+			const auto seen = static_cast<std::uint32_t>(now >> 30);
+			auto& set = sets_[index];
+
+			spin_lock_guard lock(locks_[index]);
+			entry* victim = nullptr;
+			for (auto& e : set.entries)
+			{
+				if (e.key == key)
+				{
+					++e.active;
+					e.last_seen = seen;
+					return &e;
+				}
+				// a bucket in use keeps its tunnels' charges, only idle entries are replaced
+				if (e.active == 0 && (!victim || e.last_seen < victim->last_seen))
+				{
+					victim = &e;
+				}
+			}
+			if (!victim)
+			{
+				overflows_.fetch_add(1, std::memory_order_relaxed);
+				++set.overflow.active;
+				return &set.overflow;
+			}
+			victim->key = key;
+			victim->bytes_tat.store(0, std::memory_order_relaxed);
+			victim->connect_tat.store(0, std::memory_order_relaxed);
+			victim->active = 1;
+			victim->last_seen = seen;
+			return victim;
+		}
+
+		// clients charged to an overflow bucket because their set was full
+		std::uint64_t overflows() const
+		{
+			return overflows_.load(std::memory_order_relaxed);
+		}
+
+		bool shared(const entry* e) const
+		{
+			return e == &sets_[set_index(e)].overflow;
+		}
+
+		void release(entry* e)
+		{
+			// the entry stays with its key while active
+			const auto index = set_index(e);
+			spin_lock_guard lock(locks_[index]);
+			if (e->active > 0)
+			{
+				--e->active;
+			}
+		}
+
+	private:
+		// locates the set of an entry by address
+		size_t set_index(const entry* e) const
+		{
+			return static_cast<size_t>(reinterpret_cast<const char*>(e) - reinterpret_cast<const char*>(sets_.get())) / sizeof(set_type);
+		}
+
+		size_t set_mask_;
+		std::unique_ptr<set_type[]> sets_;
+		std::unique_ptr<std::atomic_flag[]> locks_;
+		std::atomic<std::uint64_t> overflows_;
+	};
+}
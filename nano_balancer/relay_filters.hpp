@@ -0,0 +1,757 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <tuple>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/optional.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include "options.hpp"
+#include "rate_limits.hpp"
+#include "stats.hpp"
+#include "loop_monitor.hpp"
+#include "logging.h"
+
+namespace nano_balancer
+{
+	// Relay filters are static policies of the tunnel, every tunnel owns one filter instance
+	// built from a context shared by all tunnels of a listener. byte_counter, file_tap and traffic_mirror
+	// are not selected as policies, traffic_observers holds them as run time branches. A filter sees every chunk before
+	// it is written to the other side and may ask the tunnel to defer the next read.
+	// Filters must provide:
+	//   defers_reads - true if on_read may return a non zero delay
+	//   context_type(const filter_setup&)
+	//   filter(const boost::shared_ptr<context_type>&)
+	//   time_duration on_read(relay_direction, const unsigned char* data, size_t size)
+	// and may override the filter_defaults:
+	//   bool on_accept(const ip::address& client) - false closes the connection before it is routed
+	//   Handler wrap(handler_kind, Handler) - wraps the tunnel's completion handlers
+	//   void on_close()
+
+	enum relay_direction
+	{
+		to_upstream,
+		to_downstream
+	};
+
+	typedef boost::posix_time::time_duration relay_delay;
+
+	// what a filter context is built from
+	struct filter_setup
+	{
+		logger_type& logger;
+		boost::asio::io_service& ios;
+		const balancer_options& options;
+		balancer_stats& stats;
+		const loop_monitor::ptr_type& monitor;
+	};
+
+	struct filter_defaults
+	{
+		bool on_accept(const ip::address&)
+		{
+			return true;
+		}
+
+		template <class Handler>
+		Handler wrap(handler_kind, Handler handler)
+		{
+			return handler;
+		}
+
+		void on_close()
+		{
+		}
+	};
+
+	// default policy, compiles to the plain relay
+	struct no_filter : filter_defaults
+	{
+		enum { defers_reads = false };
+
+		struct context_type
+		{
+			explicit context_type(const filter_setup&)
+			{
+			}
+		};
+
+		explicit no_filter(const boost::shared_ptr<context_type>&)
+		{
+		}
+
+		relay_delay on_read(relay_direction, const unsigned char*, size_t)
+		{
+			return relay_delay();
+		}
+	};
+
+	// counts bytes per tunnel and logs the totals on close, the listener totals are kept by the tunnel
+	class byte_counter : public filter_defaults
+	{
+	public:
+		enum { defers_reads = false };
+
+		struct context_type
+		{
+			logger_type& logger;
+
+			explicit context_type(const filter_setup& setup) : logger(setup.logger)
+			{
+			}
+		};
+
+		explicit byte_counter(const boost::shared_ptr<context_type>& context) : context_(context)
+		{
+			bytes_[to_upstream] = 0;
+			bytes_[to_downstream] = 0;
+		}
+
+		relay_delay on_read(relay_direction direction, const unsigned char*, size_t size)
+		{
+			bytes_[direction] += size;
+			return relay_delay();
+		}
+
+		void on_close()
+		{
+			BOOST_LOG_SEV(context_->logger, trivial::debug) << "closed: up " << bytes_[to_upstream] << ", down " << bytes_[to_downstream] << " bytes";
+			bytes_[to_upstream] = 0;
+			bytes_[to_downstream] = 0;
+		}
+
+	private:
+		boost::shared_ptr<context_type> context_;
+		unsigned long long bytes_[2];
+	};
+
+	// Token bucket limits on bytes per second per tunnel, per client address and per listener,
+	// and on new connections per second per client address. Both directions share the buckets.
+	// Per tunnel buckets are plain fields, shared buckets are single words updated with a CAS.
+	class rate_limiter : public filter_defaults
+	{
+	public:
+		enum { defers_reads = true };
+
+		struct context_type
+		{
+			logger_type& logger;
+			const rate_limit connection;
+			const rate_limit client;
+			const rate_limit listener;
+			const rate_limit client_connects;
+			std::unique_ptr<client_limits> clients;
+			alignas(64) std::atomic<std::int64_t> listener_tat;
+
+			explicit context_type(const filter_setup& setup) :
+				logger(setup.logger),
+				connection(setup.options.connection_rate, burst(setup.options.connection_rate)),
+				client(setup.options.client_rate, burst(setup.options.client_rate)),
+				listener(setup.options.listener_rate, burst(setup.options.listener_rate)),
+				client_connects(setup.options.client_connect_rate, std::max(1.0, setup.options.client_connect_rate)),
+				listener_tat(0)
+			{
+				if (client.enabled() || client_connects.enabled())
+				{
+					clients.reset(new client_limits(setup.options.client_entries));
+				}
+			}
+
+			// one second worth of bytes, at least 64k
+			static double burst(double rate)
+			{
+				return std::max(rate, 65536.0);
+			}
+		};
+
+		explicit rate_limiter(const boost::shared_ptr<context_type>& context) :
+			context_(context),
+			client_(nullptr),
+			connection_tat_(0)
+		{
+		}
+
+		bool on_accept(const ip::address& client)
+		{
+			if (!context_->clients)
+			{
+				return true;
+			}
+			const auto now = rate_limit::now();
+			client_ = context_->clients->acquire(client, now);
+			if (context_->clients->shared(client_))
+			{
+				// limited together with the other overflowed clients of its set, logged at powers of two to keep the log quiet
+				const auto overflows = context_->clients->overflows();
+				if ((overflows & (overflows - 1)) == 0)
+				{
+					BOOST_LOG_SEV(context_->logger, trivial::warning) << "Client table full: " << overflows
+						<< " clients limited by a shared overflow bucket, raise client_entries";
+				}
+			}
+			return !context_->client_connects.enabled() || context_->client_connects.admit(client_->connect_tat, now, 1);
+		}
+
+		relay_delay on_read(relay_direction, const unsigned char*, size_t size)
+		{
+			const auto now = rate_limit::now();
+			std::int64_t wait = 0;
+			if (context_->connection.enabled())
+			{
+				wait = context_->connection.charge(connection_tat_, now, size);
+			}
+			if (client_ && context_->client.enabled())
+			{
+				wait = std::max(wait, context_->client.charge(client_->bytes_tat, now, size));
+			}
+			if (context_->listener.enabled())
+			{
+				wait = std::max(wait, context_->listener.charge(context_->listener_tat, now, size));
+			}
+			// the next read waits until the buckets are back within their burst
+			return boost::posix_time::microseconds(wait / 1000);
+		}
+
+		void on_close()
+		{
+			if (client_)
+			{
+				context_->clients->release(client_);
+				client_ = nullptr;
+			}
+		}
+
+	private:
+		boost::shared_ptr<context_type> context_;
+		client_limits::entry* client_;
+		std::int64_t connection_tat_;
+	};
+
+	// Appends every relayed chunk to a capture file as [tunnel id][direction][size][bytes].
+	// The loop thread only copies the record to a queue, a writer thread does the file writes.
+	// Records are dropped, and counted, while more than max_queued bytes wait for the writer.
+	class file_tap : public filter_defaults
+	{
+	public:
+		enum { defers_reads = false };
+
+		struct context_type
+		{
+			enum { max_queued = 64 << 20 };
+
+			logger_type& logger;
+			std::ofstream file;
+			boost::atomic<unsigned int> next_id;
+			boost::mutex mutex;
+			boost::condition_variable queued_cv;
+			std::vector<char> queued;
+			unsigned long long dropped;
+			bool stopping;
+			boost::thread writer;
+
+			explicit context_type(const filter_setup& setup) :
+				logger(setup.logger),
+				file(setup.options.tap_file, std::ios::binary | std::ios::app),
+				next_id(0),
+				dropped(0),
+				stopping(false)
+			{
+				if (!file)
+				{
+					BOOST_LOG_SEV(setup.logger, trivial::error) << "Error: Tap file open failed: " << setup.options.tap_file;
+				}
+				writer = boost::thread(boost::bind(&context_type::write_loop, this));
+			}
+
+			~context_type()
+			{
+				{
+					boost::mutex::scoped_lock lock(mutex);
+					stopping = true;
+				}
+				queued_cv.notify_one();
+				writer.join();
+			}
+
+			void push(const unsigned int (&header)[3], const unsigned char* data, size_t size)
+			{
+				boost::mutex::scoped_lock lock(mutex);
+				if (queued.size() + sizeof(header) + size > max_queued)
+				{
+					++dropped;
+					return;
+				}
+				const auto wake = queued.empty();
+				queued.insert(queued.end(), reinterpret_cast<const char*>(header), reinterpret_cast<const char*>(header) + sizeof(header));
+				queued.insert(queued.end(), reinterpret_cast<const char*>(data), reinterpret_cast<const char*>(data) + size);
+				lock.unlock();
+				if (wake)
+				{
+					queued_cv.notify_one();
+				}
+			}
+
+			void write_loop()
+			{
+				std::vector<char> writing;
+				unsigned long long reported = 0;
+				boost::mutex::scoped_lock lock(mutex);
+				for (;;)
+				{
+					while (queued.empty() && !stopping)
+					{
+						queued_cv.wait(lock);
+					}
+					if (queued.empty())
+					{
+						break;
+					}
+					writing.swap(queued);
+					const auto dropped_now = dropped;
+					lock.unlock();
+
+					file.write(writing.data(), writing.size());
+					file.flush();
+					writing.clear();
+					if (dropped_now != reported)
+					{
+						BOOST_LOG_SEV(logger, trivial::error) << "Error: Tap file writes fell behind, " << dropped_now << " records dropped";
+						reported = dropped_now;
+					}
+					lock.lock();
+				}
+			}
+		};
+
+		explicit file_tap(const boost::shared_ptr<context_type>& context) :
+			context_(context),
+			id_(++context->next_id)
+		{
+		}
+
+		relay_delay on_read(relay_direction direction, const unsigned char* data, size_t size)
+		{
+			const unsigned int header[] = { id_, static_cast<unsigned int>(direction), static_cast<unsigned int>(size) };
+			context_->push(header, data, size);
+			return relay_delay();
+		}
+
+	private:
+		boost::shared_ptr<context_type> context_;
+		const unsigned int id_;
+	};
+
+	// Best effort copy of one client's bytes to a shadow endpoint, responses are read and discarded.
+	// Chunks are copied to a buffer of at most max_queued bytes while the previous write is in flight,
+	// a leg that falls further behind is dropped, the tunnel never waits for it.
+	class shadow_leg : public boost::enable_shared_from_this<shadow_leg>
+	{
+	public:
+		enum { discard_size = 4096 };
+
+		shadow_leg(logger_type& logger, boost::asio::io_service& ios, size_t max_queued) :
+			logger_(logger),
+			socket_(ios),
+			max_queued_(max_queued),
+			connected_(false),
+			writing_(false),
+			finished_(false)
+		{
+		}
+
+		void start(const ip::tcp::endpoint& endpoint)
+		{
+			socket_.async_connect(endpoint, boost::bind(&shadow_leg::handle_connect, shared_from_this(), boost::asio::placeholders::error));
+		}
+
+		// false once the leg is dropped
+		bool push(const unsigned char* data, size_t size)
+		{
+			if (!socket_.is_open())
+			{
+				return false;
+			}
+			if (queued_.size() + size > max_queued_)
+			{
+				BOOST_LOG_SEV(logger_, trivial::debug) << "mirror dropped: " << queued_.size() << " bytes queued";
+				close();
+				return false;
+			}
+			queued_.insert(queued_.end(), data, data + size);
+			write();
+			return true;
+		}
+
+		// closes the leg once the queued bytes are written
+		void finish()
+		{
+			finished_ = true;
+			if (!writing_ && queued_.empty())
+			{
+				close();
+			}
+		}
+
+	private:
+		void handle_connect(const boost::system::error_code& error)
+		{
+			if (error)
+			{
+				BOOST_LOG_SEV(logger_, trivial::debug) << "mirror connect failed: " << error.message();
+				close();
+				return;
+			}
+			connected_ = true;
+			read();
+			write();
+			if (finished_ && queued_.empty())
+			{
+				close();
+			}
+		}
+
+		void write()
+		{
+			if (!connected_ || writing_ || queued_.empty())
+			{
+				return;
+			}
+			writing_ = true;
+			writing_buffer_.swap(queued_);
+			queued_.clear();
+			boost::asio::async_write(socket_, boost::asio::buffer(writing_buffer_),
+				boost::bind(&shadow_leg::handle_write, shared_from_this(), boost::asio::placeholders::error));
+		}
+
+		void handle_write(const boost::system::error_code& error)
+		{
+			writing_ = false;
+			if (error)
+			{
+				close();
+				return;
+			}
+			write();
+			if (finished_ && !writing_)
+			{
+				close();
+			}
+		}
+
+		void read()
+		{
+			socket_.async_read_some(boost::asio::buffer(discard_),
+				boost::bind(&shadow_leg::handle_read, shared_from_this(), boost::asio::placeholders::error));
+		}
+
+		void handle_read(const boost::system::error_code& error)
+		{
+			if (!error)
+			{
+				read();
+			}
+		}
+
+		void close()
+		{
+			boost::system::error_code ec;
+			socket_.shutdown(ip::tcp::socket::shutdown_both, ec);
+			socket_.close(ec);
+			queued_.clear();
+		}
+
+		logger_type& logger_;
+		ip::tcp::socket socket_;
+		const size_t max_queued_;
+		std::vector<unsigned char> queued_;
+		std::vector<unsigned char> writing_buffer_;
+		unsigned char discard_[discard_size];
+		bool connected_;
+		bool writing_;
+		bool finished_;
+	};
+
+	// mirrors the client to backend bytes of a sample of the connections to the shadow endpoints
+	class traffic_mirror : public filter_defaults
+	{
+	public:
+		enum { defers_reads = false };
+
+		struct context_type
+		{
+			logger_type& logger;
+			boost::asio::io_service& ios;
+			const std::vector<ip::tcp::endpoint> endpoints;
+			const double rate;
+			const size_t max_queued;
+			boost::atomic<std::uint64_t> accepted;
+			boost::atomic<std::uint64_t> mirrored;
+
+			explicit context_type(const filter_setup& setup) :
+				logger(setup.logger),
+				ios(setup.ios),
+				endpoints(setup.options.mirror_endpoints),
+				rate(std::min(1.0, setup.options.mirror_rate)),
+				max_queued(setup.options.mirror_queue),
+				accepted(0),
+				mirrored(0)
+			{
+				BOOST_LOG_SEV(logger, trivial::info) << "Mirror: " << endpoints.size() << " endpoints, rate " << rate << ", " << max_queued << " bytes queued";
+			}
+		};
+
+		explicit traffic_mirror(const boost::shared_ptr<context_type>& context) : context_(context)
+		{
+		}
+
+		bool on_accept(const ip::address&)
+		{
+			// evenly spaced sample, the n-th connection is mirrored when n * rate crosses an integer
+			const auto n = ++context_->accepted;
+			const auto sampled = static_cast<std::uint64_t>(n * context_->rate) != static_cast<std::uint64_t>((n - 1) * context_->rate);
+			if (sampled)
+			{
+				leg_ = boost::make_shared<shadow_leg>(context_->logger, context_->ios, context_->max_queued);
+				leg_->start(context_->endpoints[context_->mirrored++ % context_->endpoints.size()]);
+			}
+			return true;
+		}
+
+		relay_delay on_read(relay_direction direction, const unsigned char* data, size_t size)
+		{
+			if (leg_ && direction == to_upstream && !leg_->push(data, size))
+			{
+				leg_.reset();
+			}
+			return relay_delay();
+		}
+
+		void on_close()
+		{
+			if (leg_)
+			{
+				leg_->finish();
+				leg_.reset();
+			}
+		}
+
+	private:
+		boost::shared_ptr<context_type> context_;
+		boost::shared_ptr<shadow_leg> leg_;
+	};
+
+	// The filters that only watch the bytes and are rarely enabled, checked at run time in one filter
+	// so that each of them does not double the tunnel types the selector instantiates.
+	class traffic_observers : public filter_defaults
+	{
+	public:
+		enum { defers_reads = false };
+
+		static bool enabled(const balancer_options& options)
+		{
+			return options.count_bytes || !options.tap_file.empty() || mirrors(options);
+		}
+
+		struct context_type
+		{
+			boost::shared_ptr<byte_counter::context_type> counter;
+			boost::shared_ptr<file_tap::context_type> tap;
+			boost::shared_ptr<traffic_mirror::context_type> mirror;
+
+			explicit context_type(const filter_setup& setup)
+			{
+				if (setup.options.count_bytes) counter = boost::make_shared<byte_counter::context_type>(setup);
+				if (!setup.options.tap_file.empty()) tap = boost::make_shared<file_tap::context_type>(setup);
+				if (mirrors(setup.options)) mirror = boost::make_shared<traffic_mirror::context_type>(setup);
+			}
+		};
+
+		explicit traffic_observers(const boost::shared_ptr<context_type>& context)
+		{
+			if (context->counter) counter_.emplace(context->counter);
+			if (context->tap) tap_.emplace(context->tap);
+			if (context->mirror) mirror_.emplace(context->mirror);
+		}
+
+		bool on_accept(const ip::address& client)
+		{
+			return !mirror_ || mirror_->on_accept(client);
+		}
+
+		relay_delay on_read(relay_direction direction, const unsigned char* data, size_t size)
+		{
+			if (counter_) counter_->on_read(direction, data, size);
+			if (tap_) tap_->on_read(direction, data, size);
+			if (mirror_) mirror_->on_read(direction, data, size);
+			return relay_delay();
+		}
+
+		void on_close()
+		{
+			if (counter_) counter_->on_close();
+			if (mirror_) mirror_->on_close();
+		}
+
+	private:
+		static bool mirrors(const balancer_options& options)
+		{
+			return !options.mirror_endpoints.empty() && options.mirror_rate > 0;
+		}
+
+		boost::optional<byte_counter> counter_;
+		boost::optional<file_tap> tap_;
+		boost::optional<traffic_mirror> mirror_;
+	};
+
+	// times every tunnel completion handler with the loop monitor
+	class handler_timer : public filter_defaults
+	{
+	public:
+		enum { defers_reads = false };
+
+		struct context_type
+		{
+			loop_monitor::ptr_type monitor;
+
+			explicit context_type(const filter_setup& setup) : monitor(setup.monitor)
+			{
+			}
+		};
+
+		explicit handler_timer(const boost::shared_ptr<context_type>& context) : context_(context)
+		{
+		}
+
+		template <class Handler>
+		loop_monitor::timed_handler<Handler> wrap(handler_kind kind, Handler handler)
+		{
+			return context_->monitor->wrap(kind, std::move(handler));
+		}
+
+		relay_delay on_read(relay_direction, const unsigned char*, size_t)
+		{
+			return relay_delay();
+		}
+
+	private:
+		boost::shared_ptr<context_type> context_;
+	};
+
+	// static composition of filters, calls are resolved and inlined at compile time
+	template <class... Filters>
+	class filter_chain
+	{
+	public:
+		enum { defers_reads = (false || ... || Filters::defers_reads) };
+
+		struct context_type
+		{
+			std::tuple<boost::shared_ptr<typename Filters::context_type>...> contexts;
+
+			explicit context_type(const filter_setup& setup) :
+				contexts(boost::make_shared<typename Filters::context_type>(setup)...)
+			{
+			}
+		};
+
+		explicit filter_chain(const boost::shared_ptr<context_type>& context) :
+			filters_(Filters(std::get<boost::shared_ptr<typename Filters::context_type>>(context->contexts))...)
+		{
+		}
+
+		bool on_accept(const ip::address& client)
+		{
+			return std::apply([&](Filters&... filters) { return (true && ... && filters.on_accept(client)); }, filters_);
+		}
+
+		relay_delay on_read(relay_direction direction, const unsigned char* data, size_t size)
+		{
+			return std::apply([&](Filters&... filters)
+			{
+				relay_delay delay;
+				((delay = std::max(delay, filters.on_read(direction, data, size))), ...);
+				return delay;
+			}, filters_);
+		}
+
+		void on_close()
+		{
+			std::apply([](Filters&... filters) { (filters.on_close(), ...); }, filters_);
+		}
+
+		template <class Handler>
+		auto wrap(handler_kind kind, Handler handler)
+		{
+			return wrap_from<0>(kind, std::move(handler));
+		}
+
+	private:
+		template <size_t Index, class Handler>
+		auto wrap_from(handler_kind kind, Handler handler)
+		{
+			if constexpr (Index == sizeof...(Filters))
+			{
+				return handler;
+			}
+			else
+			{
+				return wrap_from<Index + 1>(kind, std::get<Index>(filters_).wrap(kind, std::move(handler)));
+			}
+		}
+
+		std::tuple<Filters...> filters_;
+	};
+
+	// Maps the filter options to a filter type at start up and calls run.template start<Filter>().
+	// Each enabled stage adds its filter to the chain, no options select no_filter.
+	// Every stage doubles the tunnel types compiled, so only rate_limiter and handler_timer get a stage of
+	// their own; byte_counter, file_tap and traffic_mirror share the traffic_observers stage and are
+	// branched on at run time for every chunk.
+	template <int Stage = 0, class... Filters>
+	struct filter_selector
+	{
+		template <class Run>
+		static void select(const balancer_options& options, Run& run)
+		{
+			if constexpr (Stage == 0)
+			{
+				if (options.connection_rate > 0 || options.client_rate > 0 || options.listener_rate > 0 || options.client_connect_rate > 0) filter_selector<1, Filters..., rate_limiter>::select(options, run);
+				else filter_selector<1, Filters...>::select(options, run);
+			}
+			else if constexpr (Stage == 1)
+			{
+				if (traffic_observers::enabled(options)) filter_selector<2, Filters..., traffic_observers>::select(options, run);
+				else filter_selector<2, Filters...>::select(options, run);
+			}
+			else if constexpr (Stage == 2)
+			{
+				if (options.monitor) filter_selector<3, Filters..., handler_timer>::select(options, run);
+				else filter_selector<3, Filters...>::select(options, run);
+			}
+			else if constexpr (sizeof...(Filters) == 0)
+			{
+				run.template start<no_filter>();
+			}
+			else if constexpr (sizeof...(Filters) == 1)
+			{
+				run.template start<Filters...>();
+			}
+			else
+			{
+				run.template start<filter_chain<Filters...>>();
+			}
+		}
+	};
+}
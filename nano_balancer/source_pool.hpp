@@ -0,0 +1,327 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <fstream>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/make_shared.hpp>
+#include "types.h"
+#include "logging.h"
+
+#if defined(__linux__) && !defined(IP_BIND_ADDRESS_NO_PORT)
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+namespace nano_balancer
+{
+	namespace ip = boost::asio::ip;
+
+	// Spreads upstream connections over a pool of local source addresses.
+	// Every source ip has its own ephemeral port range towards each backend ip:port,
+	// so active connections are counted per (source, backend) pair and the least used source wins.
+	// The counts cover open connections only, ports a closed connection leaves in TIME_WAIT are not counted.
+	// Per backend slots are created when the backend is added and looked up without a lock on every connect,
+	// a backend that leaves (a host name resolving to new addresses) has its entry retired so the table follows live backends.
+	class source_pool
+	{
+		enum definitions
+		{
+			default_port_count = 16384,
+			slot_buckets = 256,
+			exhausted_log_period_ms = 1000,
+			// an unlinked entry is freed once no lookup can still be on it, lookups take microseconds
+			retire_grace_ms = 1000
+		};
+
+		struct backend_slots
+		{
+			std::vector<boost::atomic<unsigned int>> active;
+
+			explicit backend_slots(size_t count) : active(count)
+			{
+				for (auto& a : active)
+				{
+					a = 0;
+				}
+			}
+		};
+
+		typedef boost::shared_ptr<backend_slots> slots_ptr;
+
+		// entries are published and unlinked under the mutex, readers walk the chains without a lock;
+		// an unlinked entry keeps its next, so a reader standing on it walks on, and is freed after retire_grace_ms
+		struct slots_entry
+		{
+			size_t hash;
+			slots_ptr slots;
+			boost::atomic<slots_entry*> next;
+		};
+
+		typedef std::chrono::steady_clock clock_type;
+
+	public:
+		typedef boost::shared_ptr<source_pool> ptr_type;
+
+		struct stats_type
+		{
+			boost::atomic<unsigned long long> connects;
+			boost::atomic<unsigned long long> exhausted;
+			boost::atomic<unsigned long long> addr_not_avail;
+
+			stats_type() : connects(0), exhausted(0), addr_not_avail(0)
+			{
+			}
+		};
+
+		// holds one port of a (source, backend) range for the lifetime of an upstream connection
+		class lease
+		{
+			slots_ptr slots_;
+			size_t index_;
+			ip::address address_;
+
+		public:
+			lease() : index_(0)
+			{
+			}
+
+			lease(const slots_ptr& slots, size_t index, const ip::address& address) :
+				slots_(slots), index_(index), address_(address)
+			{
+			}
+
+			lease(const lease&) = delete;
+			lease& operator=(const lease&) = delete;
+
+			lease& operator=(lease&& other)
+			{
+				release();
+				slots_ = std::move(other.slots_);
+				index_ = other.index_;
+				address_ = other.address_;
+				return *this;
+			}
+
+			~lease()
+			{
+				release();
+			}
+
+			bool valid() const
+			{
+				return slots_ != nullptr;
+			}
+
+			const ip::address& address() const
+			{
+				return address_;
+			}
+
+			void release()
+			{
+				if (slots_)
+				{
+					--slots_->active[index_];
+					slots_.reset();
+				}
+			}
+		};
+
+		source_pool(logger_type& logger, const std::vector<ip::address>& addresses, unsigned int port_count) :
+			logger_(logger),
+			addresses_(addresses),
+			port_count_(port_count ? port_count : system_port_count()),
+			next_(0),
+			exhausted_logged_(0),
+			exhausted_reported_(0)
+		{
+			for (auto& bucket : buckets_)
+			{
+				bucket = nullptr;
+			}
+			BOOST_LOG_SEV(logger_, trivial::info) << "Source pool: " << addresses_.size() << " addresses, " << port_count_ << " ports each";
+		}
+
+		const stats_type& stats() const
+		{
+			return stats_;
+		}
+
+		// creates the slots of a backend, called when the backend joins the config or a resolved host name
+		void add_node(const ip_node_type& node)
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			free_retired();
+			if (find_entry(node.hash))
+			{
+				return;
+			}
+			std::unique_ptr<slots_entry> entry(new slots_entry());
+			entry->hash = node.hash;
+			entry->slots = boost::make_shared<backend_slots>(addresses_.size());
+			auto& bucket = buckets_[node.hash % slot_buckets];
+			entry->next.store(bucket.load(boost::memory_order_relaxed), boost::memory_order_relaxed);
+			bucket.store(entry.get(), boost::memory_order_release);
+			entries_.push_back(std::move(entry));
+		}
+
+		// unlinks the slots of a backend that left, leases of its open connections keep the counts alive
+		void remove_node(const ip_node_type& node)
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			free_retired();
+			auto link = &buckets_[node.hash % slot_buckets];
+			for (auto entry = link->load(boost::memory_order_relaxed); entry; link = &entry->next, entry = link->load(boost::memory_order_relaxed))
+			{
+				if (entry->hash == node.hash)
+				{
+					link->store(entry->next.load(boost::memory_order_relaxed), boost::memory_order_release);
+					const auto owner = std::find_if(entries_.begin(), entries_.end(),
+						[entry](const std::unique_ptr<slots_entry>& e) { return e.get() == entry; });
+					retired_.emplace_back(clock_type::now(), std::move(*owner));
+					entries_.erase(owner);
+					return;
+				}
+			}
+		}
+
+		// picks the least used source address of the backend's family, false if all ranges are full
+		bool acquire(const ip_node_type& node, lease& result)
+		{
+			auto entry = find_entry(node.hash);
+			// a backend the probe has not announced or has just removed is counted on its own,
+			// so the table only ever holds the probe's backends
+			const auto slots = entry ? entry->slots : boost::make_shared<backend_slots>(addresses_.size());
+			const auto count = addresses_.size();
+			const auto is_v6 = node.address.is_v6();
+			// rotate the starting point so equally loaded sources share new connections
+			const auto start = next_++ % count;
+			for (auto attempt = 0; attempt < 2; ++attempt)
+			{
+				auto best = count;
+				for (size_t i = 0; i < count; ++i)
+				{
+					const auto index = (start + i) % count;
+					if (addresses_[index].is_v6() == is_v6 && (best == count || slots->active[index] < slots->active[best]))
+					{
+						best = index;
+					}
+				}
+				if (best == count)
+				{
+					BOOST_LOG_SEV(logger_, trivial::error) << "Error: No source address of the family of: " << node.address << ":" << node.port;
+					return false;
+				}
+				if (++slots->active[best] <= port_count_)
+				{
+					++stats_.connects;
+					result = lease(slots, best, addresses_[best]);
+					return true;
+				}
+				// lost a race for the last port, retry once before giving up
+				--slots->active[best];
+			}
+
+			const auto exhausted = ++stats_.exhausted;
+			// a full range rejects every new connection, so the rejections are reported at most once a period
+			const auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+			auto logged = exhausted_logged_.load(boost::memory_order_relaxed);
+			if ((logged == 0 || now - logged >= exhausted_log_period_ms) && exhausted_logged_.compare_exchange_strong(logged, now))
+			{
+				const auto reported = exhausted_reported_.exchange(exhausted);
+				BOOST_LOG_SEV(logger_, trivial::error) << "Error: Source ports exhausted for: " << node.address << ":" << node.port
+					<< " (" << exhausted - reported << " rejected since the last report, exhausted: " << exhausted
+					<< ", address not available: " << stats_.addr_not_avail << ")";
+			}
+			return false;
+		}
+
+		// opens the socket and binds it to the leased source address, the port is chosen on connect
+		void bind(ip::tcp::socket& socket, const lease& source, boost::system::error_code& ec)
+		{
+			socket.open(source.address().is_v6() ? ip::tcp::v6() : ip::tcp::v4(), ec);
+			if (ec) return;
+#if defined(IP_BIND_ADDRESS_NO_PORT)
+			// defer port selection to connect() so the port is unique per 4-tuple, not per source address;
+			// SO_REUSEADDR additionally lets the kernel reuse ports held by TIME_WAIT sockets
+			socket.set_option(ip::tcp::socket::reuse_address(true), ec);
+			if (ec) return;
+			socket.set_option(boost::asio::detail::socket_option::boolean<IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT>(true), ec);
+			if (ec) return;
+#elif defined(SO_REUSE_UNICASTPORT)
+			// windows equivalent of IP_BIND_ADDRESS_NO_PORT, SO_REUSEADDR is unsafe there
+			socket.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSE_UNICASTPORT>(true), ec);
+			if (ec) return;
+#endif
+			socket.bind(ip::tcp::endpoint(source.address(), 0), ec);
+		}
+
+		void on_connect_error(const boost::system::error_code& error)
+		{
+			if (error == boost::system::errc::address_not_available)
+			{
+				++stats_.addr_not_avail;
+			}
+		}
+
+	private:
+		const slots_entry* find_entry(size_t hash) const
+		{
+			for (auto entry = buckets_[hash % slot_buckets].load(boost::memory_order_acquire); entry; entry = entry->next.load(boost::memory_order_acquire))
+			{
+				if (entry->hash == hash)
+				{
+					return entry;
+				}
+			}
+			return nullptr;
+		}
+
+		// called under the mutex
+		void free_retired()
+		{
+			const auto now = clock_type::now();
+			while (!retired_.empty() && now - retired_.front().first >= std::chrono::milliseconds(retire_grace_ms))
+			{
+				retired_.pop_front();
+			}
+		}
+
+		static unsigned int system_port_count()
+		{
+#if defined(__linux__)
+			std::ifstream file("/proc/sys/net/ipv4/ip_local_port_range");
+			unsigned int low = 0, high = 0;
+			if (file >> low >> high && high > low)
+			{
+				return high - low + 1;
+			}
+#endif
+			return default_port_count;
+		}
+
+		logger_type& logger_;
+		std::vector<ip::address> addresses_;
+		const unsigned int port_count_;
+		boost::atomic<size_t> next_;
+		boost::atomic<long long> exhausted_logged_;
+		boost::atomic<unsigned long long> exhausted_reported_;
+		// guards adding and unlinking entries, lookups only read the buckets
+		boost::mutex mutex_;
+		boost::atomic<slots_entry*> buckets_[slot_buckets];
+		std::vector<std::unique_ptr<slots_entry>> entries_;
+		// unlinked entries and when they were unlinked, oldest first
+		std::deque<std::pair<clock_type::time_point, std::unique_ptr<slots_entry>>> retired_;
+		stats_type stats_;
+	};
+}
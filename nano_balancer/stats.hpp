@@ -0,0 +1,238 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/process/environment.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include "logging.h"
+
+namespace nano_balancer
+{
+	namespace ip = boost::asio::ip;
+
+	// process local counters, updated by the tunnels
+	struct balancer_stats
+	{
+		boost::atomic<std::uint64_t> accepted;
+		boost::atomic<std::uint64_t> rejected;
+		boost::atomic<std::uint64_t> closed;
+		boost::atomic<std::uint64_t> connect_failures;
+		boost::atomic<std::uint64_t> bytes_up;
+		boost::atomic<std::uint64_t> bytes_down;
+
+		balancer_stats() : accepted(0), rejected(0), closed(0), connect_failures(0), bytes_up(0), bytes_down(0)
+		{
+		}
+	};
+
+	// Fixed binary layout of a balancer child stats segment, version 1.
+	// The child is the only writer, sequence is odd while an update is in progress.
+	struct stats_segment
+	{
+		enum definitions
+		{
+			magic_value = 0x5453424E, // "NBST"
+			version_value = 1,
+			max_backends = 256,
+			update_period_ms = 250
+		};
+
+		struct backend
+		{
+			std::uint8_t address[16];
+			std::uint16_t port;
+			std::uint8_t is_v6;
+			std::uint8_t healthy;
+			std::uint32_t latency_us;
+			std::uint64_t reserved;
+		};
+
+		std::uint32_t magic;
+		std::uint32_t version;
+		std::atomic<std::uint32_t> sequence;
+		std::uint32_t pid;
+		std::uint64_t updated_ms;
+		std::uint64_t accepted;
+		std::uint64_t rejected;
+		std::uint64_t closed;
+		std::uint64_t connect_failures;
+		std::uint64_t bytes_up;
+		std::uint64_t bytes_down;
+		std::uint32_t backend_count;
+		std::uint32_t reserved;
+		backend backends[max_backends];
+
+		static std::string name(const std::string& local_host, const std::string& local_port)
+		{
+			// ipv6 hosts have colons, which are not valid in windows object and file names
+			auto host = local_host;
+			std::replace(host.begin(), host.end(), ':', '_');
+			return "nano_balancer_stats_" + host + "_" + local_port;
+		}
+	};
+
+	// Copies the process counters into the child's segment from a timer on the child's io_service.
+	// Tunnels never touch shared memory, readers never block the writer.
+	class stats_publisher : public boost::enable_shared_from_this<stats_publisher>
+	{
+	public:
+		typedef boost::function<std::uint32_t(stats_segment::backend*, std::uint32_t)> backends_function;
+
+		stats_publisher(logger_type& logger, boost::asio::io_service& ios, const std::string& name,
+			const balancer_stats& stats, backends_function backends) :
+			logger_(logger),
+			name_(name),
+			stats_(stats),
+			backends_(backends),
+			timer_(ios),
+			segment_(nullptr)
+		{
+			using namespace boost::interprocess;
+			shared_memory_object::remove(name_.c_str());
+			shared_memory_object shm(create_only, name_.c_str(), read_write);
+			shm.truncate(sizeof(stats_segment));
+			region_ = mapped_region(shm, read_write);
+			std::memset(region_.get_address(), 0, sizeof(stats_segment));
+			segment_ = static_cast<stats_segment*>(region_.get_address());
+			segment_->magic = stats_segment::magic_value;
+			segment_->version = stats_segment::version_value;
+			segment_->pid = static_cast<std::uint32_t>(boost::this_process::get_id());
+			BOOST_LOG_SEV(logger_, trivial::info) << "Stats segment: " << name_;
+		}
+
+		~stats_publisher()
+		{
+			boost::interprocess::shared_memory_object::remove(name_.c_str());
+		}
+
+		void start()
+		{
+			publish();
+			timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(stats_segment::update_period_ms)));
+			timer_.async_wait(boost::bind(&stats_publisher::on_timer, shared_from_this(), boost::asio::placeholders::error));
+		}
+
+	private:
+		void on_timer(const boost::system::error_code& error)
+		{
+			if (!error)
+			{
+				start();
+			}
+		}
+
+		void publish()
+		{
+			auto& s = *segment_;
+			const auto sequence = s.sequence.load(std::memory_order_relaxed);
+			s.sequence.store(sequence + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+
+			s.updated_ms = (boost::posix_time::microsec_clock::universal_time() - boost::posix_time::from_time_t(0)).total_milliseconds();
+			s.accepted = stats_.accepted.load(boost::memory_order_relaxed);
+			s.rejected = stats_.rejected.load(boost::memory_order_relaxed);
+			s.closed = stats_.closed.load(boost::memory_order_relaxed);
+			s.connect_failures = stats_.connect_failures.load(boost::memory_order_relaxed);
+			s.bytes_up = stats_.bytes_up.load(boost::memory_order_relaxed);
+			s.bytes_down = stats_.bytes_down.load(boost::memory_order_relaxed);
+			s.backend_count = backends_ ? backends_(s.backends, stats_segment::max_backends) : 0;
+
+			s.sequence.store(sequence + 2, std::memory_order_release);
+		}
+
+		logger_type& logger_;
+		const std::string name_;
+		const balancer_stats& stats_;
+		backends_function backends_;
+		boost::asio::deadline_timer timer_;
+		boost::interprocess::mapped_region region_;
+		stats_segment* segment_;
+	};
+
+	// read only view of a child's segment for the master
+	class stats_reader
+	{
+	public:
+		enum definitions
+		{
+			max_attempts = 100
+		};
+
+		explicit stats_reader(const std::string& name) :
+			name_(name),
+			segment_(nullptr)
+		{
+		}
+
+		// consistent copy of the segment, false if the segment does not exist (yet) or is unreadable
+		bool read(stats_segment& result)
+		{
+			if (!segment_ && !open())
+			{
+				return false;
+			}
+			for (auto attempt = 0; attempt < max_attempts; ++attempt)
+			{
+				const auto before = segment_->sequence.load(std::memory_order_acquire);
+				if (before & 1)
+				{
+					continue;
+				}
+				std::memcpy(static_cast<void*>(&result), segment_, sizeof(stats_segment));
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (segment_->sequence.load(std::memory_order_relaxed) == before)
+				{
+					return result.magic == stats_segment::magic_value && result.version == stats_segment::version_value;
+				}
+			}
+			return false;
+		}
+
+		// drops the mapping, a restarted child creates a new segment
+		void reset()
+		{
+			region_ = boost::interprocess::mapped_region();
+			segment_ = nullptr;
+		}
+
+	private:
+		bool open()
+		{
+			using namespace boost::interprocess;
+			try
+			{
+				shared_memory_object shm(open_only, name_.c_str(), read_only);
+				region_ = mapped_region(shm, read_only);
+				if (region_.get_size() < sizeof(stats_segment))
+				{
+					reset();
+					return false;
+				}
+				segment_ = static_cast<const stats_segment*>(region_.get_address());
+				return true;
+			}
+			catch (interprocess_exception&)
+			{
+				return false;
+			}
+		}
+
+		const std::string name_;
+		boost::interprocess::mapped_region region_;
+		const stats_segment* segment_;
+	};
+}
@@ -0,0 +1,240 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <stdexcept>
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include "options.hpp"
+#include "logging.h"
+
+// TLS termination needs OpenSSL, build with NANO_BALANCER_TLS defined and link libssl and libcrypto
+#if defined(NANO_BALANCER_TLS)
+#include <memory>
+#include <utility>
+#include <csignal>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <boost/asio/ssl/error.hpp>
+#endif
+
+namespace nano_balancer
+{
+	namespace ip = boost::asio::ip;
+
+#if defined(NANO_BALANCER_TLS)
+	// Server side TLS on an accepted socket, OpenSSL reads and writes the socket itself (socket BIO).
+	// That is what lets OpenSSL install the kTLS keys after the handshake: with a memory BIO pair,
+	// as asio's ssl::stream uses, the kernel never sees the session. The socket is non-blocking,
+	// operations that want the socket wait for readiness on the reactor and are retried.
+	// Provides async_read_some/async_write_some for the directions the kernel does not encrypt.
+	class tls_connection
+	{
+	public:
+		typedef ip::tcp::socket::executor_type executor_type;
+
+		tls_connection(ip::tcp::socket& socket, SSL_CTX* context) :
+			socket_(socket),
+			ssl_(SSL_new(context), &SSL_free)
+		{
+			if (ssl_)
+			{
+				boost::system::error_code ec;
+				socket_.non_blocking(true, ec);
+				// a handshake flight goes out in several writes, with Nagle the tail waits for the client's delayed ack
+				socket_.set_option(ip::tcp::no_delay(true), ec);
+				SSL_set_fd(ssl_.get(), static_cast<int>(socket_.native_handle()));
+				SSL_set_mode(ssl_.get(), SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+			}
+		}
+
+		SSL* native_handle()
+		{
+			return ssl_.get();
+		}
+
+		executor_type get_executor()
+		{
+			return socket_.get_executor();
+		}
+
+		// handler(error, 0)
+		template <class Handler>
+		void async_handshake(Handler handler)
+		{
+			if (!ssl_)
+			{
+				complete(handler, boost::asio::error::no_memory, 0);
+				return;
+			}
+			perform([](SSL* ssl, size_t&) { return SSL_accept(ssl); }, std::move(handler));
+		}
+
+		template <class MutableBuffers, class Handler>
+		void async_read_some(const MutableBuffers& buffers, Handler handler)
+		{
+			const boost::asio::mutable_buffer buffer = *boost::asio::buffer_sequence_begin(buffers);
+			perform([buffer](SSL* ssl, size_t& bytes) { return SSL_read_ex(ssl, buffer.data(), buffer.size(), &bytes); }, std::move(handler));
+		}
+
+		template <class ConstBuffers, class Handler>
+		void async_write_some(const ConstBuffers& buffers, Handler handler)
+		{
+			const boost::asio::const_buffer buffer = *boost::asio::buffer_sequence_begin(buffers);
+			perform([buffer](SSL* ssl, size_t& bytes) { return SSL_write_ex(ssl, buffer.data(), buffer.size(), &bytes); }, std::move(handler));
+		}
+
+		// sends close_notify without waiting for the peer's, the socket is closed right after
+		void shutdown()
+		{
+			if (ssl_ && SSL_is_init_finished(ssl_.get()))
+			{
+				ERR_clear_error();
+				SSL_shutdown(ssl_.get());
+				ERR_clear_error();
+			}
+		}
+
+	private:
+		// runs the operation until it completes or fails, the owner keeps the connection alive through the handler
+		template <class Operation, class Handler>
+		void perform(Operation operation, Handler handler)
+		{
+			ERR_clear_error();
+			size_t bytes = 0;
+			const auto result = operation(ssl_.get(), bytes);
+			if (result > 0)
+			{
+				complete(handler, boost::system::error_code(), bytes);
+				return;
+			}
+			const auto error = SSL_get_error(ssl_.get(), result);
+			if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+			{
+				socket_.async_wait(error == SSL_ERROR_WANT_READ ? ip::tcp::socket::wait_read : ip::tcp::socket::wait_write,
+					[this, operation, handler](const boost::system::error_code& ec) mutable
+					{
+						if (ec)
+						{
+							handler(ec, 0);
+							return;
+						}
+						perform(operation, std::move(handler));
+					});
+				return;
+			}
+			if (error == SSL_ERROR_ZERO_RETURN || (error == SSL_ERROR_SYSCALL && ERR_peek_error() == 0))
+			{
+				// close_notify or the peer closed the socket
+				complete(handler, boost::asio::error::eof, 0);
+				return;
+			}
+			complete(handler, boost::system::error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category()), 0);
+		}
+
+		// completions never run inside the initiating call
+		template <class Handler>
+		void complete(Handler& handler, const boost::system::error_code& error, size_t bytes)
+		{
+			boost::asio::post(socket_.get_executor(), [handler, error, bytes]() mutable { handler(error, bytes); });
+		}
+
+		ip::tcp::socket& socket_;
+		std::unique_ptr<SSL, void (*)(SSL*)> ssl_;
+	};
+
+	// Listener wide TLS server settings shared by all tunnels.
+	// Handshakes run in user space with a server session cache and session tickets for resumption.
+	// With SSL_OP_ENABLE_KTLS OpenSSL hands the traffic keys to the kernel after the handshake,
+	// the tunnel then relays that direction with plain socket I/O and no user space crypto.
+	class tls_context
+	{
+	public:
+		typedef boost::shared_ptr<tls_context> ptr_type;
+		typedef tls_connection stream_type;
+
+		tls_context(logger_type& logger, const balancer_options& options) :
+			logger_(logger),
+			context_(SSL_CTX_new(TLS_server_method()), &SSL_CTX_free),
+			handshake_timeout_(boost::posix_time::seconds(options.tls_handshake_sec))
+		{
+			auto native = context_.get();
+			if (!native)
+			{
+				throw std::runtime_error("SSL_CTX_new failed");
+			}
+#if !defined(_WIN32)
+			// OpenSSL writes the client socket with plain write(), a write to a reset connection
+			// (close_notify to a client that already left) must fail with EPIPE, not kill the child
+			std::signal(SIGPIPE, SIG_IGN);
+#endif
+			SSL_CTX_set_min_proto_version(native, TLS1_2_VERSION);
+			SSL_CTX_set_options(native, SSL_OP_ALL | SSL_OP_SINGLE_DH_USE);
+#if defined(SSL_OP_IGNORE_UNEXPECTED_EOF)
+			// most clients close without close_notify, OpenSSL 3 would fail the read with a decode_error alert
+			SSL_CTX_set_options(native, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+			if (SSL_CTX_use_certificate_chain_file(native, options.tls_cert.c_str()) != 1)
+			{
+				throw std::runtime_error("TLS certificate chain failed: " + options.tls_cert);
+			}
+			const auto& key = options.tls_key.empty() ? options.tls_cert : options.tls_key;
+			if (SSL_CTX_use_PrivateKey_file(native, key.c_str(), SSL_FILETYPE_PEM) != 1)
+			{
+				throw std::runtime_error("TLS private key failed: " + key);
+			}
+
+			static const unsigned char session_id_context[] = "nano_balancer";
+			SSL_CTX_set_session_id_context(native, session_id_context, sizeof(session_id_context) - 1);
+			SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+			SSL_CTX_sess_set_cache_size(native, options.tls_session_cache);
+#if defined(SSL_OP_ENABLE_KTLS)
+			SSL_CTX_set_options(native, SSL_OP_ENABLE_KTLS);
+			BOOST_LOG_SEV(logger_, trivial::info) << "TLS: " << options.tls_cert << ", kTLS enabled";
+#else
+			BOOST_LOG_SEV(logger_, trivial::info) << "TLS: " << options.tls_cert << ", kTLS not supported by OpenSSL";
+#endif
+		}
+
+		SSL_CTX* native_handle()
+		{
+			return context_.get();
+		}
+
+		// clients that do not complete the handshake in time are closed
+		const boost::posix_time::time_duration& handshake_timeout() const
+		{
+			return handshake_timeout_;
+		}
+
+		// tells which directions the kernel encrypts after the completed handshake
+		void on_handshake(stream_type& stream, bool& ktls_send, bool& ktls_recv)
+		{
+			auto ssl = stream.native_handle();
+			ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl)) != 0;
+			ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl)) != 0;
+			BOOST_LOG_SEV(logger_, trivial::debug) << "tls: " << SSL_get_version(ssl) << " " << SSL_get_cipher_name(ssl)
+				<< (SSL_session_reused(ssl) ? ", resumed" : "") << ", kTLS send " << ktls_send << ", recv " << ktls_recv;
+		}
+
+	private:
+		logger_type& logger_;
+		std::unique_ptr<SSL_CTX, void (*)(SSL_CTX*)> context_;
+		const boost::posix_time::time_duration handshake_timeout_;
+	};
+#else
+	// TLS termination is not compiled in, a tls_cert option fails at start up
+	class tls_context
+	{
+	public:
+		typedef boost::shared_ptr<tls_context> ptr_type;
+
+		tls_context(logger_type&, const balancer_options&)
+		{
+			throw std::runtime_error("TLS support is not compiled in, build with NANO_BALANCER_TLS");
+		}
+	};
+#endif
+}
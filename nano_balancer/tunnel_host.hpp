@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <array>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
@@ -12,24 +13,39 @@
 #include <boost/make_shared.hpp>
 #include "types.h"
 #include "logging.h"
+#include "source_pool.hpp"
+#include "proxy_protocol.hpp"
+#include "tls.hpp"
+#include "relay_filters.hpp"
+#include "stats.hpp"
+#include "flight_recorder.hpp"
 
 namespace nano_balancer
 {
 	namespace ip = boost::asio::ip;
 
-	class tunnel : public boost::enable_shared_from_this<tunnel>
+	// Relays bytes between the accepted client and its backend.
+	// Filter is a static relay policy from relay_filters.hpp, no_filter is the plain relay.
+	template <class Filter>
+	class basic_tunnel : public boost::enable_shared_from_this<basic_tunnel<Filter>>
 	{
 	public:
 
 		typedef ip::tcp::socket socket_type;
-		typedef boost::shared_ptr<tunnel> ptr_type;
+		typedef boost::shared_ptr<basic_tunnel> ptr_type;
+		typedef boost::shared_ptr<typename Filter::context_type> filter_context_ptr;
 
 	private:
 		logger_type logger_;
 		socket_type downstream_;
 		socket_type upstream_;
 
-		enum { buffer_size = 8192 };
+		enum
+		{
+			buffer_size = 8192,
+			// relayed bytes are added to the listener counters once this many are pending, and on close
+			publish_bytes = 1 << 20
+		};
 		unsigned char downstream_buffer_[buffer_size];
 		unsigned char upstream_buffer_[buffer_size];
 
@@ -37,14 +53,89 @@ namespace nano_balancer
 
 		boost::atomic<int> pending_operations;
 		boost::atomic<bool> error_flag;
+
+		source_pool::ptr_type source_pool_;
+		source_pool::lease source_lease_;
+
+		proxy_protocol::version proxy_version_;
+		unsigned char proxy_header_[proxy_protocol::max_size];
+
+		// timers for deferred reads, only present when the filter can defer
+		struct no_read_timers
+		{
+			explicit no_read_timers(boost::asio::io_service&)
+			{
+			}
+			void cancel()
+			{
+			}
+		};
+
+		struct read_timers
+		{
+			boost::asio::deadline_timer timer[2];
+			relay_delay delay[2];
+
+			explicit read_timers(boost::asio::io_service& ios) : timer{ boost::asio::deadline_timer(ios), boost::asio::deadline_timer(ios) }
+			{
+			}
+			void cancel()
+			{
+				boost::system::error_code ec;
+				timer[to_upstream].cancel(ec);
+				timer[to_downstream].cancel(ec);
+			}
+		};
+
+		balancer_stats& stats_;
+		Filter filter_;
+		bool closed_;
+		typename std::conditional<Filter::defers_reads, read_timers, no_read_timers>::type read_timers_;
+
+		// TLS termination, downstream directions the kernel does not encrypt (no kTLS) are relayed through the stream
+		tls_context::ptr_type tls_;
+#if defined(NANO_BALANCER_TLS)
+		std::unique_ptr<tls_context::stream_type> tls_stream_;
+		std::unique_ptr<boost::asio::deadline_timer> handshake_timer_;
+#endif
+		bool tls_reads_;
+		bool tls_writes_;
+		// passive health signal, the backend refused or did not answer a relayed connection
+		boost::function<void(const ip_node_type&)> upstream_failed_;
+		ip_node_type upstream_node_;
+		// lifecycle events for the flight recorder, the first close reason wins
+		flight_recorder::ptr_type recorder_;
+		const std::uint32_t connection_;
+		std::uint64_t relayed_[2];
+		std::uint64_t published_[2];
+		flight_recorder::close_reason close_reason_;
+		std::int64_t close_code_;
 	public:
 
-		explicit tunnel(logger_type& logger, boost::asio::io_service& ios) :
+		explicit basic_tunnel(logger_type& logger, boost::asio::io_service& ios, const source_pool::ptr_type& sources,
+			proxy_protocol::version proxy_version, const tls_context::ptr_type& tls, const filter_context_ptr& filter_context, balancer_stats& stats,
+			const boost::function<void(const ip_node_type&)>& upstream_failed, const flight_recorder::ptr_type& recorder) :
 			logger_(logger),
 			downstream_(ios),
 			upstream_(ios),
 			pending_operations(0),
-			error_flag(false)
+			error_flag(false),
+			source_pool_(sources),
+			proxy_version_(proxy_version),
+			stats_(stats),
+			filter_(filter_context),
+			closed_(false),
+			read_timers_(ios),
+			tls_(tls),
+			tls_reads_(false),
+			tls_writes_(false),
+			upstream_failed_(upstream_failed),
+			recorder_(recorder),
+			connection_(recorder ? recorder->next_connection() : 0),
+			relayed_(),
+			published_(),
+			close_reason_(flight_recorder::close_reasons),
+			close_code_(0)
 		{
 		}
 
@@ -58,45 +149,296 @@ namespace nano_balancer
 			return upstream_;
 		}
 
-		void start(const ip::address_v4& upstream_host, unsigned short upstream_port)
+		// runs the filter accept check, the tunnel is closed if the filter rejects the client
+		bool accept(const ip::tcp::endpoint& client)
 		{
-			BOOST_LOG_SEV(logger_, trivial::debug) << "connecting: " << upstream_host << ":" << upstream_port;
-			upstream_.async_connect(
-				ip::tcp::endpoint(upstream_host,
-					upstream_port),
-				boost::bind(&tunnel::handle_upstream_connect,
-					shared_from_this(),
+			trace(flight_recorder::accepted, client.address(), client.port());
+			if (!filter_.on_accept(client.address()))
+			{
+				BOOST_LOG_SEV(logger_, trivial::debug) << "rejected: " << client;
+				++stats_.rejected;
+				set_close_reason(flight_recorder::rejected);
+				close();
+				return false;
+			}
+			return true;
+		}
+
+		void start(const ip_node_type& upstream_node)
+		{
+			trace(flight_recorder::backend_chosen, upstream_node.address, upstream_node.port);
+#if defined(NANO_BALANCER_TLS)
+			if (tls_)
+			{
+				// the handshake completes before the backend is connected
+				tls_stream_.reset(new tls_context::stream_type(downstream_, tls_->native_handle()));
+				handshake_timer_.reset(new boost::asio::deadline_timer(downstream_.get_executor(), tls_->handshake_timeout()));
+				handshake_timer_->async_wait(boost::bind(&basic_tunnel::handle_handshake_timer,
+					this->shared_from_this(),
 					boost::asio::placeholders::error));
+				tls_stream_->async_handshake(
+					filter_.wrap(connect_handler, boost::bind(&basic_tunnel::handle_handshake,
+						this->shared_from_this(),
+						boost::asio::placeholders::error,
+						upstream_node)));
+				return;
+			}
+#endif
+			connect_upstream(upstream_node);
+		}
+
+		void connect_upstream(const ip_node_type& upstream_node)
+		{
+			BOOST_LOG_SEV(logger_, trivial::debug) << "connecting: " << upstream_node.address << ":" << upstream_node.port;
+			if (upstream_node.port == 0)
+			{
+				set_close_reason(flight_recorder::no_backend);
+				close();
+				return;
+			}
+			upstream_node_ = upstream_node;
+			if (source_pool_)
+			{
+				boost::system::error_code ec;
+				if (!source_pool_->acquire(upstream_node, source_lease_))
+				{
+					set_close_reason(flight_recorder::no_source);
+					close();
+					return;
+				}
+				source_pool_->bind(upstream_, source_lease_, ec);
+				if (ec)
+				{
+					BOOST_LOG_SEV(logger_, trivial::error) << "Error: Upstream bind failed: " << source_lease_.address() << ", " << ec.message();
+					set_close_reason(flight_recorder::bind_failed, ec);
+					close();
+					return;
+				}
+			}
+			trace(flight_recorder::connect_started);
+			upstream_.async_connect(
+				ip::tcp::endpoint(upstream_node.address,
+					upstream_node.port),
+				filter_.wrap(connect_handler, boost::bind(&basic_tunnel::handle_upstream_connect,
+					this->shared_from_this(),
+					boost::asio::placeholders::error)));
 		}
 
 		void handle_upstream_connect(const boost::system::error_code& error)
 		{
 			if (!error)
 			{
-				upstream_.async_read_some(
-					boost::asio::buffer(upstream_buffer_, buffer_size),
-					boost::bind(&tunnel::handle_upstream_read,
-						shared_from_this(),
-						boost::asio::placeholders::error,
-						boost::asio::placeholders::bytes_transferred));
+				trace(flight_recorder::connected);
+				read_upstream();
 
-				downstream_.async_read_some(
-					boost::asio::buffer(downstream_buffer_, buffer_size),
-					boost::bind(&tunnel::handle_downstream_read,
-						shared_from_this(),
-						boost::asio::placeholders::error,
-						boost::asio::placeholders::bytes_transferred));
+				if (proxy_version_ != proxy_protocol::none)
+				{
+					send_proxy_header();
+					return;
+				}
+
+				read_downstream();
 			}
 			else
 			{
 				BOOST_LOG_SEV(logger_, trivial::error) << "Error: Upstream connect failed: " << error.value() << ", " << error.message();
+				if (source_pool_)
+				{
+					source_pool_->on_connect_error(error);
+				}
+				++stats_.connect_failures;
+				if (upstream_failed_ && error != boost::system::errc::address_not_available && error != boost::asio::error::operation_aborted)
+				{
+					upstream_failed_(upstream_node_);
+				}
+				set_close_reason(flight_recorder::connect_failed, error);
 				close();
 			}
 		}
 
 	private:
+#if defined(NANO_BALANCER_TLS)
+		void handle_handshake_timer(const boost::system::error_code& error)
+		{
+			if (error)
+			{
+				return;
+			}
+			BOOST_LOG_SEV(logger_, trivial::error) << "Error: TLS handshake timed out";
+			set_close_reason(flight_recorder::handshake_failed, boost::asio::error::timed_out);
+			close();
+		}
+
+		void handle_handshake(const boost::system::error_code& error, const ip_node_type& upstream_node)
+		{
+			boost::system::error_code ec;
+			handshake_timer_->cancel(ec);
+			if (error)
+			{
+				BOOST_LOG_SEV(logger_, trivial::error) << "Error: TLS handshake failed: " << error.message();
+				set_close_reason(flight_recorder::handshake_failed, error);
+				close();
+				return;
+			}
+			bool ktls_send = false;
+			bool ktls_recv = false;
+			tls_->on_handshake(*tls_stream_, ktls_send, ktls_recv);
+			tls_reads_ = !ktls_recv;
+			tls_writes_ = !ktls_send;
+			trace(flight_recorder::handshake_done);
+			connect_upstream(upstream_node);
+		}
+#endif
+
+		// writes the PROXY header, together with any client bytes already received,
+		// the downstream read loop starts once the write completes
+		void send_proxy_header()
+		{
+			boost::system::error_code ec;
+			const auto source = downstream_.remote_endpoint(ec);
+			const auto destination = ec ? ip::tcp::endpoint() : downstream_.local_endpoint(ec);
+			const auto header_size = ec ? 0 : proxy_protocol::write_header(proxy_version_, source, destination, proxy_header_);
+			if (header_size == 0)
+			{
+				BOOST_LOG_SEV(logger_, trivial::error) << "Error: PROXY header failed: " << ec.message();
+				set_close_reason(flight_recorder::proxy_header_failed, ec);
+				close();
+				return;
+			}
+
+			// only read what is already queued, a server-speaks-first backend must not wait for the client;
+			// queued TLS bytes may be a partial record, those are left to the read loop
+			size_t payload_size = 0;
+			if (!tls_ && downstream_.available(ec) > 0 && !ec)
+			{
+				payload_size = downstream_.read_some(boost::asio::buffer(downstream_buffer_, buffer_size), ec);
+				if (ec)
+				{
+					payload_size = 0;
+				}
+				count_relayed(to_upstream, payload_size);
+				save_delay(to_upstream, filter_.on_read(to_upstream, downstream_buffer_, payload_size));
+			}
+
+			const std::array<boost::asio::const_buffer, 2> buffers = {
+				boost::asio::buffer(proxy_header_, header_size),
+				boost::asio::buffer(downstream_buffer_, payload_size)
+			};
+			++pending_operations;
+			async_write(upstream_,
+				buffers,
+				filter_.wrap(write_handler, boost::bind(&basic_tunnel::handle_upstream_write,
+					this->shared_from_this(),
+					boost::asio::placeholders::error)));
+		}
+
+		void read_downstream()
+		{
+			auto handler = filter_.wrap(read_handler, boost::bind(&basic_tunnel::handle_downstream_read,
+				this->shared_from_this(),
+				boost::asio::placeholders::error,
+				boost::asio::placeholders::bytes_transferred));
+#if defined(NANO_BALANCER_TLS)
+			if (tls_reads_)
+			{
+				tls_stream_->async_read_some(boost::asio::buffer(downstream_buffer_, buffer_size), handler);
+				return;
+			}
+#endif
+			downstream_.async_read_some(boost::asio::buffer(downstream_buffer_, buffer_size), handler);
+		}
+
+		void read_upstream()
+		{
+			upstream_.async_read_some(
+				boost::asio::buffer(upstream_buffer_, buffer_size),
+				filter_.wrap(read_handler, boost::bind(&basic_tunnel::handle_upstream_read,
+					this->shared_from_this(),
+					boost::asio::placeholders::error,
+					boost::asio::placeholders::bytes_transferred)));
+		}
+
+		void save_delay(relay_direction direction, const relay_delay& delay)
+		{
+			if constexpr (Filter::defers_reads)
+			{
+				read_timers_.delay[direction] = delay;
+			}
+		}
+
+		// issues the next read of the direction, after the delay requested by the filter if any
+		void read_next(relay_direction direction)
+		{
+			if constexpr (Filter::defers_reads)
+			{
+				if (read_timers_.delay[direction] > relay_delay())
+				{
+					auto& timer = read_timers_.timer[direction];
+					timer.expires_from_now(read_timers_.delay[direction]);
+					read_timers_.delay[direction] = relay_delay();
+					timer.async_wait(filter_.wrap(read_handler, boost::bind(&basic_tunnel::handle_read_timer,
+						this->shared_from_this(),
+						boost::asio::placeholders::error,
+						direction)));
+					return;
+				}
+			}
+			direction == to_upstream ? read_downstream() : read_upstream();
+		}
+
+		void handle_read_timer(const boost::system::error_code& error, relay_direction direction)
+		{
+			if (!error)
+			{
+				direction == to_upstream ? read_downstream() : read_upstream();
+			}
+		}
+
+		template <class... Args>
+		void trace(flight_recorder::event_kind kind, Args... args)
+		{
+			if (recorder_)
+			{
+				recorder_->record(connection_, kind, args...);
+			}
+		}
+
+		void set_close_reason(flight_recorder::close_reason reason, const boost::system::error_code& error = boost::system::error_code())
+		{
+			if (close_reason_ == flight_recorder::close_reasons)
+			{
+				close_reason_ = reason;
+				close_code_ = error.value();
+			}
+		}
+
+		void count_relayed(relay_direction direction, size_t bytes)
+		{
+			if (relayed_[direction] == 0 && bytes > 0)
+			{
+				trace(flight_recorder::first_byte, static_cast<std::uint8_t>(direction));
+			}
+			relayed_[direction] += bytes;
+			if (relayed_[direction] - published_[direction] >= publish_bytes)
+			{
+				publish_relayed(direction);
+			}
+		}
+
+		// per tunnel totals go to the shared counters in large steps, not one atomic add per chunk
+		void publish_relayed(relay_direction direction)
+		{
+			auto& counter = direction == to_upstream ? stats_.bytes_up : stats_.bytes_down;
+			counter.fetch_add(relayed_[direction] - published_[direction], boost::memory_order_relaxed);
+			published_[direction] = relayed_[direction];
+		}
+
 		bool check_error(const boost::system::error_code& error)
 		{
+			if (error)
+			{
+				set_close_reason(error == boost::asio::error::eof ? flight_recorder::closed_by_peer : flight_recorder::closed_on_error, error);
+			}
 			if ((error_flag || error) && pending_operations == 0)
 			{
 				BOOST_LOG_SEV(logger_, trivial::error) << "Error: Check error: " << error.value() << ", " << error.message();
@@ -116,12 +458,7 @@ namespace nano_balancer
 			--pending_operations;
 			if (check_error(error))
 			{
-				upstream_.async_read_some(
-					boost::asio::buffer(upstream_buffer_, buffer_size),
-					boost::bind(&tunnel::handle_upstream_read,
-						shared_from_this(),
-						boost::asio::placeholders::error,
-						boost::asio::placeholders::bytes_transferred));
+				read_next(to_downstream);
 			}
 		}
 
@@ -130,12 +467,14 @@ namespace nano_balancer
 		{
 			if (check_error(error))
 			{
+				count_relayed(to_upstream, bytes_transferred);
+				save_delay(to_upstream, filter_.on_read(to_upstream, downstream_buffer_, bytes_transferred));
 				++pending_operations;
 				async_write(upstream_,
 					boost::asio::buffer(downstream_buffer_, bytes_transferred),
-					boost::bind(&tunnel::handle_upstream_write,
-						shared_from_this(),
-						boost::asio::placeholders::error));
+					filter_.wrap(write_handler, boost::bind(&basic_tunnel::handle_upstream_write,
+						this->shared_from_this(),
+						boost::asio::placeholders::error)));
 			}
 		}
 
@@ -144,12 +483,7 @@ namespace nano_balancer
 			--pending_operations;
 			if (check_error(error))
 			{
-				downstream_.async_read_some(
-					boost::asio::buffer(downstream_buffer_, buffer_size),
-					boost::bind(&tunnel::handle_downstream_read,
-						shared_from_this(),
-						boost::asio::placeholders::error,
-						boost::asio::placeholders::bytes_transferred));
+				read_next(to_upstream);
 			}
 		}
 
@@ -158,12 +492,20 @@ namespace nano_balancer
 		{
 			if (check_error(error))
 			{
+				count_relayed(to_downstream, bytes_transferred);
+				save_delay(to_downstream, filter_.on_read(to_downstream, upstream_buffer_, bytes_transferred));
 				++pending_operations;
-				async_write(downstream_,
-					boost::asio::buffer(upstream_buffer_, bytes_transferred),
-					boost::bind(&tunnel::handle_downstream_write,
-						shared_from_this(),
-						boost::asio::placeholders::error));
+				auto handler = filter_.wrap(write_handler, boost::bind(&basic_tunnel::handle_downstream_write,
+					this->shared_from_this(),
+					boost::asio::placeholders::error));
+#if defined(NANO_BALANCER_TLS)
+				if (tls_writes_)
+				{
+					async_write(*tls_stream_, boost::asio::buffer(upstream_buffer_, bytes_transferred), handler);
+					return;
+				}
+#endif
+				async_write(downstream_, boost::asio::buffer(upstream_buffer_, bytes_transferred), handler);
 			}
 		}
 
@@ -175,6 +517,12 @@ namespace nano_balancer
 			{
 				if (downstream_.is_open())
 				{
+#if defined(NANO_BALANCER_TLS)
+					if (tls_stream_)
+					{
+						tls_stream_->shutdown();
+					}
+#endif
 					downstream_.shutdown(boost::asio::socket_base::shutdown_both);
 					downstream_.close();
 				}
@@ -200,6 +548,23 @@ namespace nano_balancer
 				upstream_.close();
 				BOOST_LOG_SEV(logger_, trivial::error) << "Upstream closed";
 			}
+
+			source_lease_.release();
+			read_timers_.cancel();
+			if (!closed_)
+			{
+				closed_ = true;
+				filter_.on_close();
+				++stats_.closed;
+				publish_relayed(to_upstream);
+				publish_relayed(to_downstream);
+				if (recorder_)
+				{
+					recorder_->record(connection_, flight_recorder::byte_totals, 0, relayed_[to_upstream], relayed_[to_downstream]);
+					recorder_->record(connection_, flight_recorder::closed,
+						close_reason_ == flight_recorder::close_reasons ? flight_recorder::closed_by_peer : close_reason_, close_code_);
+				}
+			}
 		}
 
 	public:
@@ -209,23 +574,31 @@ namespace nano_balancer
 			tunnel_host(logger_type& logger,
 				boost::asio::io_service& io_service,
 				const std::string& local_host, unsigned short local_port,
-				boost::function<ip_node_type()> next_upstream)
+				boost::function<ip_node_type(const ip::address&)> next_upstream,
+				boost::function<void(const ip_node_type&)> upstream_failed,
+				const source_pool::ptr_type& sources,
+				proxy_protocol::version proxy_version,
+				const tls_context::ptr_type& tls,
+				const filter_context_ptr& filter_context,
+				balancer_stats& stats,
+				const flight_recorder::ptr_type& recorder)
 				: io_service_(io_service),
-				localhost_address(boost::asio::ip::address_v4::from_string(local_host)),
+				localhost_address(boost::asio::ip::address::from_string(local_host)),
 				tcp_acceptor_(io_service_, ip::tcp::endpoint(localhost_address, local_port)),
-				next_upstream_(next_upstream), logger_(logger)
+				next_upstream_(next_upstream), upstream_failed_(upstream_failed), logger_(logger), source_pool_(sources),
+				proxy_version_(proxy_version), tls_(tls), filter_context_(filter_context), stats_(stats), recorder_(recorder)
 			{}
 
 			bool run()
 			{
 				try
 				{
-					tunnel_ = boost::make_shared<tunnel>(logger_, io_service_);
+					tunnel_ = boost::make_shared<basic_tunnel>(logger_, io_service_, source_pool_, proxy_version_, tls_, filter_context_, stats_, upstream_failed_, recorder_);
 
 					tcp_acceptor_.async_accept(tunnel_->downstream_socket(),
-						boost::bind(&tunnel_host::handle_accept,
+						tunnel_->filter_.wrap(accept_handler, boost::bind(&tunnel_host::handle_accept,
 							this,
-							boost::asio::placeholders::error));
+							boost::asio::placeholders::error)));
 				}
 				catch (std::exception& e)
 				{
@@ -242,8 +615,14 @@ namespace nano_balancer
 			{
 				if (!error)
 				{
-					auto next_node = next_upstream_();
-					tunnel_->start(next_node.address, next_node.port);
+					++stats_.accepted;
+					boost::system::error_code ec;
+					const auto client = tunnel_->downstream_socket().remote_endpoint(ec);
+					if (tunnel_->accept(client))
+					{
+						auto next_node = next_upstream_(client.address());
+						tunnel_->start(next_node);
+					}
 
 					if (!run())
 					{
@@ -257,11 +636,20 @@ namespace nano_balancer
 			}
 
 			boost::asio::io_service& io_service_;
-			ip::address_v4 localhost_address;
+			ip::address localhost_address;
 			ip::tcp::acceptor tcp_acceptor_;
 			ptr_type tunnel_;
-			boost::function<ip_node_type()> next_upstream_;
+			boost::function<ip_node_type(const ip::address&)> next_upstream_;
+			boost::function<void(const ip_node_type&)> upstream_failed_;
 			logger_type logger_;
+			source_pool::ptr_type source_pool_;
+			proxy_protocol::version proxy_version_;
+			tls_context::ptr_type tls_;
+			filter_context_ptr filter_context_;
+			balancer_stats& stats_;
+			flight_recorder::ptr_type recorder_;
 		};
 	};
+
+	typedef basic_tunnel<no_filter> tunnel;
 }
@@ -3,7 +3,8 @@
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 #pragma once
-#include <boost/asio/ip/address_v4.hpp>
+#include <string>
+#include <boost/asio/ip/address.hpp>
 #include <boost/functional/hash.hpp>
 
 namespace nano_balancer
@@ -13,7 +14,7 @@ namespace nano_balancer
 
 	struct ip_node_type
 	{		
-		boost::asio::ip::address_v4 address;
+		boost::asio::ip::address address;
 		unsigned short port;
 		size_t hash;
 	
@@ -21,7 +22,7 @@ namespace nano_balancer
 		{
 		}
 
-		ip_node_type(boost::asio::ip::address_v4 address, unsigned short port) :
+		ip_node_type(boost::asio::ip::address address, unsigned short port) :
 			address(address),
 			port(port)
 		{			
@@ -34,10 +35,31 @@ namespace nano_balancer
 		}
 	};
 
+	// backend config entry published as a DNS name, expanded into one ip_node_type per resolved address
+	struct host_name_type
+	{
+		std::string name;
+		unsigned short port;
+
+		host_name_type(const std::string& name, unsigned short port) :
+			name(name),
+			port(port)
+		{
+		}
+	};
+
 	inline std::size_t hash_value(ip_node_type const& node)
 	{
 		std::size_t seed = 0;
-		boost::hash_combine(seed, node.address.to_ulong());
+		if (node.address.is_v4())
+		{
+			boost::hash_combine(seed, node.address.to_v4().to_ulong());
+		}
+		else
+		{
+			const auto bytes = node.address.to_v6().to_bytes();
+			boost::hash_range(seed, bytes.begin(), bytes.end());
+		}
 		boost::hash_combine(seed, node.port);		
 		return seed;
 	}
@@ -0,0 +1,496 @@
+//          Copyright Michael Shmalko 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
+#include "types.h"
+#include "client_key.hpp"
+#include "stats.hpp"
+#include "loop_monitor.hpp"
+#include "logging.h"
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#endif
+
+namespace nano_balancer
+{
+	namespace ip = boost::asio::ip;
+
+	// UDP listener mode. Every client endpoint is a flow with its own connected upstream socket
+	// towards the backend picked for it, so backend replies map back to the client without a lookup.
+	// Sockets are waited on with the reactor and drained in batches, with recvmmsg/sendmmsg on linux
+	// one system call moves up to batch_size datagrams. Replies of all flows ready in a loop turn
+	// are collected and go out of the listener together. Flows idle for idle_sec are closed,
+	// datagrams of new clients are dropped while max_flows are open.
+	class udp_host
+	{
+		enum definitions
+		{
+			batch_size = 32,
+			datagram_size = 65536,
+			// batches drained per readiness event before other sockets get their turn
+			max_batches = 8,
+			expiry_period_sec = 1,
+			// pause before the listener waits again after a failed wait
+			listener_retry_ms = 100
+		};
+
+		struct flow
+		{
+			ip::udp::endpoint client;
+			ip_node_type node;
+			ip::udp::socket upstream;
+			std::uint32_t last_active;
+
+			flow(boost::asio::io_service& ios, const ip::udp::endpoint& client, const ip_node_type& node) :
+				client(client),
+				node(node),
+				upstream(ios),
+				last_active(0)
+			{
+			}
+		};
+
+		typedef boost::shared_ptr<flow> flow_ptr;
+
+		struct flow_hash
+		{
+			size_t operator()(const ip::udp::endpoint& client) const
+			{
+				return static_cast<size_t>(client_hash(client_key(client.address()) ^ (static_cast<std::uint64_t>(client.port()) << 40)) >> 32);
+			}
+		};
+
+		// datagram buffers of one receive, reused by all sockets of the single threaded io_service
+		struct datagram_batch
+		{
+			std::unique_ptr<unsigned char[]> data;
+			// sender of a received datagram, destination of an addressed send
+			ip::udp::endpoint endpoints[batch_size];
+			size_t sizes[batch_size];
+#if defined(__linux__)
+			mmsghdr messages[batch_size];
+			iovec vectors[batch_size];
+#endif
+
+			datagram_batch() : data(new unsigned char[batch_size * datagram_size])
+			{
+			}
+
+			unsigned char* datagram(size_t index)
+			{
+				return data.get() + index * datagram_size;
+			}
+		};
+
+	public:
+		udp_host(logger_type& logger,
+			boost::asio::io_service& io_service,
+			const std::string& local_host, unsigned short local_port,
+			boost::function<ip_node_type(const ip::address&)> next_upstream,
+			unsigned int idle_sec,
+			size_t max_flows,
+			balancer_stats& stats,
+			const loop_monitor::ptr_type& monitor)
+			: logger_(logger),
+			io_service_(io_service),
+			listener_(io_service, ip::udp::endpoint(ip::address::from_string(local_host), local_port)),
+			next_upstream_(next_upstream),
+			idle_sec_(idle_sec),
+			max_flows_(max_flows),
+			expiry_timer_(io_service),
+			listener_timer_(io_service),
+			stats_(stats),
+			monitor_(monitor),
+			epoch_(std::chrono::steady_clock::now()),
+			dropped_(0),
+			failed_(0),
+			listener_failed_(0),
+			send_failed_(0),
+			dropped_report_(0),
+			failed_report_(0),
+			listener_report_(0),
+			send_report_(0),
+			reply_count_(0),
+			flush_posted_(false)
+		{
+			listener_.non_blocking(true);
+		}
+
+		void run()
+		{
+			wait_listener();
+			expiry_timer_.expires_from_now(boost::posix_time::seconds(static_cast<long>(expiry_period_sec)));
+			expiry_timer_.async_wait(boost::bind(&udp_host::handle_expiry_timer, this, boost::asio::placeholders::error));
+		}
+
+	private:
+		void wait_listener()
+		{
+			listener_.async_wait(ip::udp::socket::wait_read,
+				boost::bind(&udp_host::handle_listener_read, this, boost::asio::placeholders::error));
+		}
+
+		void wait_upstream(const flow_ptr& f)
+		{
+			f->upstream.async_wait(ip::udp::socket::wait_read,
+				boost::bind(&udp_host::handle_upstream_read, this, boost::asio::placeholders::error, f));
+		}
+
+		// client datagrams, consecutive datagrams of one flow go upstream in one batch
+		void handle_listener_read(const boost::system::error_code& error)
+		{
+			loop_monitor::scope timing(monitor_.get(), read_handler);
+			if (error == boost::asio::error::operation_aborted)
+			{
+				return;
+			}
+			const auto now = now_sec();
+			if (error)
+			{
+				// the listener is the only way in, it keeps waiting whatever the error, after a pause
+				++listener_failed_;
+				if (report_due(listener_report_, now))
+				{
+					BOOST_LOG_SEV(logger_, trivial::error) << "Error: Listener wait failed: " << error.message()
+						<< " (" << listener_failed_ << " failures)";
+				}
+				listener_timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(listener_retry_ms)));
+				listener_timer_.async_wait(boost::bind(&udp_host::handle_listener_timer, this, boost::asio::placeholders::error));
+				return;
+			}
+			for (auto round = 0; round < max_batches; ++round)
+			{
+				const auto count = receive(listener_, batch_);
+				size_t first = 0;
+				while (first < count)
+				{
+					auto last = first + 1;
+					while (last < count && batch_.endpoints[last] == batch_.endpoints[first])
+					{
+						++last;
+					}
+					auto f = get_flow(batch_.endpoints[first], now);
+					if (f)
+					{
+						stats_.bytes_up.fetch_add(send(f->upstream, batch_, first, last - first, false), boost::memory_order_relaxed);
+					}
+					first = last;
+				}
+				if (count < batch_size)
+				{
+					break;
+				}
+			}
+			wait_listener();
+		}
+
+		void handle_listener_timer(const boost::system::error_code& error)
+		{
+			if (!error)
+			{
+				wait_listener();
+			}
+		}
+
+		// backend datagrams of one flow, addressed to the client and added to the replies of this loop turn;
+		// the flush is posted behind the other handlers the reactor found ready, a full batch goes out at once
+		void handle_upstream_read(const boost::system::error_code& error, const flow_ptr& f)
+		{
+			loop_monitor::scope timing(monitor_.get(), read_handler);
+			if (error || !f->upstream.is_open())
+			{
+				return;
+			}
+			f->last_active = now_sec();
+			for (auto round = 0; round < max_batches; ++round)
+			{
+				const auto room = batch_size - reply_count_;
+				const auto count = receive(f->upstream, replies_, reply_count_);
+				for (auto i = reply_count_; i < reply_count_ + count; ++i)
+				{
+					replies_.endpoints[i] = f->client;
+				}
+				reply_count_ += count;
+				if (reply_count_ == batch_size)
+				{
+					flush_replies();
+				}
+				if (count < room)
+				{
+					break;
+				}
+			}
+			if (reply_count_ > 0 && !flush_posted_)
+			{
+				flush_posted_ = true;
+				io_service_.post(boost::bind(&udp_host::handle_flush, this));
+			}
+			wait_upstream(f);
+		}
+
+		void handle_flush()
+		{
+			flush_posted_ = false;
+			flush_replies();
+		}
+
+		void flush_replies()
+		{
+			stats_.bytes_down.fetch_add(send(listener_, replies_, 0, reply_count_, true), boost::memory_order_relaxed);
+			reply_count_ = 0;
+		}
+
+		void handle_expiry_timer(const boost::system::error_code& error)
+		{
+			if (error)
+			{
+				return;
+			}
+			const auto now = now_sec();
+			for (auto i = flows_.begin(); i != flows_.end();)
+			{
+				if (now - i->second->last_active >= idle_sec_)
+				{
+					BOOST_LOG_SEV(logger_, trivial::debug) << "udp expired: " << i->first;
+					boost::system::error_code ec;
+					i->second->upstream.close(ec);
+					++stats_.closed;
+					i = flows_.erase(i);
+				}
+				else
+				{
+					++i;
+				}
+			}
+			expiry_timer_.expires_from_now(boost::posix_time::seconds(static_cast<long>(expiry_period_sec)));
+			expiry_timer_.async_wait(boost::bind(&udp_host::handle_expiry_timer, this, boost::asio::placeholders::error));
+		}
+
+		// finds the client's flow or routes a new one, null when the datagram has to be dropped
+		flow_ptr get_flow(const ip::udp::endpoint& client, std::uint32_t now)
+		{
+			auto i = flows_.find(client);
+			if (i != flows_.end())
+			{
+				i->second->last_active = now;
+				return i->second;
+			}
+
+			if (flows_.size() >= max_flows_)
+			{
+				++dropped_;
+				++stats_.rejected;
+				if (report_due(dropped_report_, now))
+				{
+					BOOST_LOG_SEV(logger_, trivial::error) << "Error: UDP flow limit " << max_flows_ << " reached, "
+						<< dropped_ << " datagrams of new clients dropped";
+				}
+				return flow_ptr();
+			}
+			const auto node = next_upstream_(client.address());
+			if (node.port == 0)
+			{
+				return flow_ptr();
+			}
+			auto f = boost::make_shared<flow>(io_service_, client, node);
+			boost::system::error_code ec;
+			f->upstream.open(node.address.is_v6() ? ip::udp::v6() : ip::udp::v4(), ec);
+			if (!ec) f->upstream.non_blocking(true, ec);
+			if (!ec) f->upstream.connect(ip::udp::endpoint(node.address, node.port), ec);
+			if (ec)
+			{
+				++failed_;
+				++stats_.connect_failures;
+				if (report_due(failed_report_, now))
+				{
+					BOOST_LOG_SEV(logger_, trivial::error) << "Error: Upstream socket failed: " << node.address << ":" << node.port << ", " << ec.message()
+						<< " (" << failed_ << " failures)";
+				}
+				return flow_ptr();
+			}
+			BOOST_LOG_SEV(logger_, trivial::debug) << "udp flow: " << client << " -> " << node.address << ":" << node.port;
+			++stats_.accepted;
+			f->last_active = now;
+			flows_.emplace(client, f);
+			wait_upstream(f);
+			return f;
+		}
+
+		// reads queued datagrams without blocking into the slots from first on, returns the number read
+		size_t receive(ip::udp::socket& socket, datagram_batch& batch, size_t first = 0)
+		{
+#if defined(__linux__)
+			for (size_t i = first; i < batch_size; ++i)
+			{
+				batch.vectors[i].iov_base = batch.datagram(i);
+				batch.vectors[i].iov_len = datagram_size;
+				auto& header = batch.messages[i].msg_hdr;
+				header = msghdr();
+				header.msg_name = batch.endpoints[i].data();
+				header.msg_namelen = static_cast<socklen_t>(batch.endpoints[i].capacity());
+				header.msg_iov = &batch.vectors[i];
+				header.msg_iovlen = 1;
+			}
+			const auto result = ::recvmmsg(socket.native_handle(), &batch.messages[first], static_cast<unsigned int>(batch_size - first), MSG_DONTWAIT, nullptr);
+			if (result <= 0)
+			{
+				return 0;
+			}
+			for (auto i = first; i < first + result; ++i)
+			{
+				batch.endpoints[i].resize(batch.messages[i].msg_hdr.msg_namelen);
+				// truncated datagrams are dropped by the send
+				batch.sizes[i] = (batch.messages[i].msg_hdr.msg_flags & MSG_TRUNC) ? 0 : batch.messages[i].msg_len;
+			}
+			return static_cast<size_t>(result);
+#else
+			size_t count = first;
+			boost::system::error_code ec;
+			for (; count < batch_size; ++count)
+			{
+				batch.sizes[count] = socket.receive_from(boost::asio::buffer(batch.datagram(count), datagram_size), batch.endpoints[count], 0, ec);
+				if (ec)
+				{
+					break;
+				}
+			}
+			return count - first;
+#endif
+		}
+
+		// sends datagrams [first, first + count) to the connected peer or, addressed, each to its endpoint,
+		// returns the bytes sent; datagrams the socket buffer has no room for are dropped,
+		// a datagram the socket rejects otherwise (unreachable client, refused port) is skipped
+		size_t send(ip::udp::socket& socket, datagram_batch& batch, size_t first, size_t count, bool addressed)
+		{
+			size_t bytes = 0;
+#if defined(__linux__)
+			size_t prepared = 0;
+			for (size_t i = first; i < first + count; ++i)
+			{
+				if (batch.sizes[i] == 0)
+				{
+					continue;
+				}
+				// the headers of the sent range are rebuilt in place, later ranges only need their endpoints and sizes
+				auto& message = batch.messages[first + prepared];
+				batch.vectors[first + prepared].iov_base = batch.datagram(i);
+				batch.vectors[first + prepared].iov_len = batch.sizes[i];
+				message.msg_hdr = msghdr();
+				message.msg_hdr.msg_name = addressed ? batch.endpoints[i].data() : nullptr;
+				message.msg_hdr.msg_namelen = addressed ? static_cast<socklen_t>(batch.endpoints[i].size()) : 0;
+				message.msg_hdr.msg_iov = &batch.vectors[first + prepared];
+				message.msg_hdr.msg_iovlen = 1;
+				++prepared;
+			}
+			size_t sent = 0;
+			while (sent < prepared)
+			{
+				const auto result = ::sendmmsg(socket.native_handle(), &batch.messages[first + sent], static_cast<unsigned int>(prepared - sent), MSG_DONTWAIT);
+				if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+				{
+					// the first message of the rest failed, the ones behind it still go
+					send_failed(boost::system::error_code(errno, boost::system::system_category()));
+					++sent;
+					continue;
+				}
+				if (result <= 0)
+				{
+					break;
+				}
+				for (auto i = 0; i < result; ++i)
+				{
+					bytes += batch.messages[first + sent + i].msg_len;
+				}
+				sent += result;
+			}
+#else
+			boost::system::error_code ec;
+			for (size_t i = first; i < first + count; ++i)
+			{
+				if (batch.sizes[i] == 0)
+				{
+					continue;
+				}
+				const auto buffer = boost::asio::buffer(batch.datagram(i), batch.sizes[i]);
+				bytes += addressed ? socket.send_to(buffer, batch.endpoints[i], 0, ec) : socket.send(buffer, 0, ec);
+				if (ec == boost::asio::error::would_block || ec == boost::asio::error::no_buffer_space)
+				{
+					break;
+				}
+				if (ec)
+				{
+					send_failed(ec);
+				}
+			}
+#endif
+			return bytes;
+		}
+
+		void send_failed(const boost::system::error_code& error)
+		{
+			++send_failed_;
+			if (report_due(send_report_, now_sec()))
+			{
+				BOOST_LOG_SEV(logger_, trivial::error) << "Error: UDP send failed: " << error.message()
+					<< " (" << send_failed_ << " datagrams)";
+			}
+		}
+
+		// errors repeated for every datagram are logged at most once a second, with their running count
+		static bool report_due(std::uint32_t& next_report, std::uint32_t now)
+		{
+			if (now < next_report)
+			{
+				return false;
+			}
+			next_report = now + 1;
+			return true;
+		}
+
+		std::uint32_t now_sec() const
+		{
+			return static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - epoch_).count());
+		}
+
+		logger_type& logger_;
+		boost::asio::io_service& io_service_;
+		ip::udp::socket listener_;
+		boost::function<ip_node_type(const ip::address&)> next_upstream_;
+		const std::uint32_t idle_sec_;
+		const size_t max_flows_;
+		boost::asio::deadline_timer expiry_timer_;
+		boost::asio::deadline_timer listener_timer_;
+		balancer_stats& stats_;
+		loop_monitor::ptr_type monitor_;
+		const std::chrono::steady_clock::time_point epoch_;
+		// datagrams dropped at the flow limit, upstream sockets that failed, failed listener waits,
+		// datagrams a send rejected, and the second each may be logged again
+		std::uint64_t dropped_;
+		std::uint64_t failed_;
+		std::uint64_t listener_failed_;
+		std::uint64_t send_failed_;
+		std::uint32_t dropped_report_;
+		std::uint32_t failed_report_;
+		std::uint32_t listener_report_;
+		std::uint32_t send_report_;
+		std::unordered_map<ip::udp::endpoint, flow_ptr, flow_hash> flows_;
+		datagram_batch batch_;
+		// backend replies of the current loop turn, each addressed to its client
+		datagram_batch replies_;
+		size_t reply_count_;
+		bool flush_posted_;
+	};
+}